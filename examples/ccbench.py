@@ -0,0 +1,331 @@
+#!/usr/bin/env python
+
+"""
+ccbench.py: compare TCP congestion control algorithms on a dumbbell
+
+For each combination of congestion control variant, RTT mix, flow
+count and bottleneck rate, we build a dumbbell
+
+    h1 --+                      +-- r1
+    h2 --+-- s1 ==(rate)== s2 --+-- r2
+    ..   |                      |   ..
+    hN --+                      +-- rN
+
+where s1-s2 is a TCLink with the given rate and queue size, and each
+sender's access link adds its flow's RTT (RTT mixes are assigned to
+flows round robin). All N flows hI -> rI run at once with iperf3 -C
+<variant>, while each sender pings its receiver to measure queueing
+delay, i.e. RTT above the idle RTT measured just before the flows
+start.
+
+Each run is reported as one JSON line on stdout:
+
+  { "variant": "reno_abc", "rate": 10, "flows": 4, "rtts": [10, 80],
+    "duration": 20, "throughput": [...], "total": 9.5,
+    "utilization": 0.95, "jain": 0.98, "retransmits": 120,
+    "qdelay": { "p50": 12.1, "p90": 30.2, "p99": 41.0, "max": 44.5 } }
+
+with rates and throughput in Mbps, and delays in ms.
+
+Variants the kernel doesn't already provide are loaded first, from
+the Reno module built by 'make' (reno_custom.ko) and failing that
+with 'modprobe tcp_<variant>'.
+
+With --baseline, results are compared with those of an earlier run,
+and we exit with status 1 if any metric regressed by more than
+--tolerance, so that changes to a CCA can be gated on this benchmark.
+
+Requires iperf3 and ping.
+"""
+
+import json
+import os
+import re
+import sys
+from math import ceil
+from optparse import OptionParser  # pylint: disable=deprecated-module
+from shutil import rmtree
+from tempfile import mkdtemp
+from time import sleep
+
+from mininet.net import Mininet
+from mininet.node import OVSBridge
+from mininet.topo import Topo
+from mininet.link import TCLink
+from mininet.log import setLogLevel, info, error
+from mininet.moduledeps import lsmod, modprobe, pathCheck
+from mininet.util import irange, quietRun
+
+
+MODULE = os.path.join( os.path.dirname( os.path.realpath( __file__ ) ),
+                       '..', 'reno_custom.ko' )
+AVAILABLE = '/proc/sys/net/ipv4/tcp_available_congestion_control'
+PORT = 5201
+PINGINTERVAL = .2
+
+# Metrics we gate on: ( name, +1 if higher is better or -1 if lower is,
+# absolute change always allowed, regardless of tolerance )
+METRICS = ( ( 'total', 1, 0 ),
+            ( 'jain', 1, 0 ),
+            ( 'qdelay.p99', -1, 1.0 ),
+            ( 'retransmits', -1, 10 ) )
+
+
+class DumbbellTopo( Topo ):
+    "N senders and N receivers on either side of one bottleneck link"
+
+    # pylint: disable=arguments-differ
+    def build( self, n=2, rate=10, queue=100, rtts=( 20, ) ):
+        s1, s2 = self.addSwitch( 's1' ), self.addSwitch( 's2' )
+        self.addLink( s1, s2, bw=rate, max_queue_size=queue )
+        for i in irange( 1, n ):
+            rtt = rtts[ ( i - 1 ) % len( rtts ) ]
+            # netem must hold a round trip's worth of packets
+            bdp = int( rate * 1e3 * rtt / 8 / 1500 )
+            # Delay is added in each direction, hence rtt/2
+            self.addLink( self.addHost( 'h%d' % i ), s1,
+                          delay='%.3fms' % ( rtt / 2.0 ),
+                          max_queue_size=max( 1000, 2 * bdp ) )
+            self.addLink( self.addHost( 'r%d' % i ), s2 )
+
+
+def available():
+    "Return the congestion control algorithms the kernel provides"
+    with open( AVAILABLE ) as f:
+        return f.read().split()
+
+def loadVariants( variants, module=MODULE ):
+    """Make sure the kernel provides all of variants, loading module
+       or tcp_<variant> as needed
+       returns: True if all are available"""
+    missing = [ v for v in variants if v not in available() ]
+    if missing and os.path.exists( module ):
+        name = os.path.basename( module ).split( '.' )[ 0 ]
+        if name not in lsmod():
+            info( '*** Loading', module, '\n' )
+            quietRun( [ 'insmod', module ] )
+    for variant in variants:
+        if variant not in available():
+            modprobe( 'tcp_' + variant )
+        if variant not in available():
+            error( 'Congestion control %s is not available\n' % variant )
+            return False
+    return True
+
+
+def jain( values ):
+    "Jain's fairness index of values"
+    squares = sum( x * x for x in values )
+    if not squares:
+        return 0.0
+    return sum( values ) ** 2 / ( len( values ) * squares )
+
+def percentile( values, pct ):
+    "Nearest-rank percentile of sorted values"
+    if not values:
+        return None
+    return values[ max( 0, int( ceil( len( values ) * pct / 100.0 ) ) - 1 ) ]
+
+def pingTimes( output ):
+    "Return RTTs in ms from ping output"
+    return [ float( t ) for t in re.findall( r'time=([\d.]+) ms', output ) ]
+
+def waitIperf( host, port=PORT, timeout=10 ):
+    "Wait until an iperf3 server on host is listening on port"
+    for _ in range( int( timeout / .1 ) ):
+        if host.cmd( 'ss -Hltn sport = :%d' % port ).strip():
+            return True
+        sleep( .1 )
+    return False
+
+
+def runFlows( net, variant, duration, tmpdir ):
+    """Run simultaneous iperf3 flows hI -> rI with variant
+       returns: dict of results, or None if a flow failed"""
+    senders = [ h for h in net.hosts if h.name.startswith( 'h' ) ]
+    pairs = [ ( h, net[ 'r' + h.name[ 1: ] ] ) for h in senders ]
+    idle = {}
+    for sender, receiver in pairs:
+        receiver.cmd( 'iperf3 -s -p %d >/dev/null 2>&1 &' % PORT )
+        times = pingTimes( sender.cmd( 'ping -n -c 5 -i', PINGINTERVAL,
+                                       receiver.IP() ) )
+        if not times or not waitIperf( receiver ):
+            error( 'No connectivity from %s to %s\n' % ( sender, receiver ) )
+            return None
+        idle[ sender ] = min( times )
+    for sender, receiver in pairs:
+        path = os.path.join( tmpdir, sender.name )
+        # keep iperf3's warnings out of its JSON
+        sender.cmd( 'iperf3 -J -c %s -p %d -t %d -C %s > %s.json 2> %s.err &'
+                    % ( receiver.IP(), PORT, duration, variant, path, path ) )
+        sender.cmd( 'ping -n -i %s -w %d %s > %s.ping 2>&1 &' %
+                    ( PINGINTERVAL, duration, receiver.IP(), path ) )
+    throughput, retransmits, qdelay = [], 0, []
+    for sender, receiver in pairs:
+        sender.cmd( 'wait' )
+        path = os.path.join( tmpdir, sender.name )
+        try:
+            with open( path + '.json' ) as f:
+                end = json.load( f )[ 'end' ]
+            throughput.append(
+                end[ 'sum_received' ][ 'bits_per_second' ] / 1e6 )
+            retransmits += end[ 'sum_sent' ].get( 'retransmits', 0 )
+        except ( IOError, ValueError, KeyError ):
+            with open( path + '.err' ) as f:
+                error( 'iperf3 failed on %s: %s\n' % ( sender, f.read() ) )
+            return None
+        with open( path + '.ping' ) as f:
+            qdelay += [ max( t - idle[ sender ], 0 )
+                        for t in pingTimes( f.read() ) ]
+    qdelay.sort()
+    return { 'throughput': throughput,
+             'total': sum( throughput ),
+             'jain': jain( throughput ),
+             'retransmits': retransmits,
+             'qdelay': { 'p50': percentile( qdelay, 50 ),
+                         'p90': percentile( qdelay, 90 ),
+                         'p99': percentile( qdelay, 99 ),
+                         'max': qdelay[ -1 ] if qdelay else None } }
+
+def ccbench( variants, rttMixes, flowCounts, rates, queue=100,
+             duration=20 ):
+    """Run every combination of parameters, yielding a dict of
+       results for each run that succeeded"""
+    tmpdir = mkdtemp( prefix='ccbench' )
+    try:
+        for rate in rates:
+            for rtts in rttMixes:
+                for n in flowCounts:
+                    topo = DumbbellTopo( n=n, rate=rate, queue=queue,
+                                         rtts=rtts )
+                    net = Mininet( topo=topo, switch=OVSBridge,
+                                   link=TCLink, controller=None,
+                                   autoStaticArp=True )
+                    net.start()
+                    for variant in variants:
+                        info( '*** %s: %d flows at %s Mbps, RTTs %s ms\n' %
+                              ( variant, n, rate, rtts ) )
+                        result = runFlows( net, variant, duration, tmpdir )
+                        for host in net.hosts:
+                            host.cmd( 'kill %iperf3 %ping 2>/dev/null; wait' )
+                        if result is None:
+                            continue
+                        result.update( variant=variant, rate=rate,
+                                       flows=n, rtts=list( rtts ),
+                                       duration=duration,
+                                       utilization=result[ 'total' ] / rate )
+                        yield result
+                    net.stop()
+    finally:
+        rmtree( tmpdir )
+
+
+def runKey( result ):
+    "Return what identifies a run's parameters"
+    return ( result[ 'variant' ], result[ 'rate' ], result[ 'flows' ],
+             tuple( result[ 'rtts' ] ), result[ 'duration' ] )
+
+def metric( result, name ):
+    "Return a (possibly nested, e.g. qdelay.p99) metric of result"
+    for key in name.split( '.' ):
+        result = result.get( key ) if result is not None else None
+    return result
+
+def regressions( results, baseline, tolerance=.1 ):
+    """Compare results with those of a baseline run
+       tolerance: allowed relative change for the worse
+       returns: list of regression descriptions"""
+    base = dict( ( runKey( r ), r ) for r in baseline )
+    found = []
+    for result in results:
+        old = base.get( runKey( result ) )
+        if old is None:
+            continue
+        for name, sign, slack in METRICS:
+            new, prev = metric( result, name ), metric( old, name )
+            if new is None or prev is None:
+                continue
+            if sign > 0:
+                worse = new < prev * ( 1 - tolerance ) - slack
+            else:
+                worse = new > prev * ( 1 + tolerance ) + slack
+            if worse:
+                found.append( '%s %d flows %s Mbps RTTs %s: %s %s -> %s' %
+                              ( result[ 'variant' ], result[ 'flows' ],
+                                result[ 'rate' ], result[ 'rtts' ], name,
+                                prev, new ) )
+    return found
+
+
+def parseList( value, kind=float ):
+    "Parse a comma-separated list"
+    return [ kind( v ) for v in value.split( ',' ) if v ]
+
+def parseArgs( argv ):
+    "Parse command line"
+    parser = OptionParser( usage='%prog [options]' )
+    parser.add_option( '-v', '--variants',
+                       default='reno,reno_custom,reno_abc,reno_balanced',
+                       help='congestion control algorithms, comma separated '
+                       '[%default]' )
+    parser.add_option( '-r', '--rtts', action='append', default=[],
+                       help='RTT mix in ms, comma separated, assigned to '
+                       'flows round robin; may be repeated [20 and 10,80]' )
+    parser.add_option( '-n', '--flows', default='2,8',
+                       help='flow counts, comma separated [%default]' )
+    parser.add_option( '-b', '--rates', default='10,100',
+                       help='bottleneck rates in Mbps, comma separated '
+                       '[%default]' )
+    parser.add_option( '-q', '--queue', type='int', default=100,
+                       help='bottleneck queue size in packets [%default]' )
+    parser.add_option( '-t', '--time', type='int', default=20,
+                       help='seconds per run [%default]' )
+    parser.add_option( '-m', '--module', default=MODULE,
+                       help='module providing our variants [%default]' )
+    parser.add_option( '-o', '--output',
+                       help='also write JSON lines to this file' )
+    parser.add_option( '--baseline',
+                       help='JSON lines of an earlier run to compare with' )
+    parser.add_option( '--tolerance', type='float', default=.1,
+                       help='allowed relative regression [%default]' )
+    opts, args = parser.parse_args( argv )
+    if args:
+        parser.error( 'unexpected arguments: %s' % ' '.join( args ) )
+    return opts
+
+def main( argv ):
+    "Run the benchmark; return exit status"
+    opts = parseArgs( argv )
+    variants = parseList( opts.variants, str )
+    rttMixes = [ parseList( r ) for r in opts.rtts ] or [ [ 20 ], [ 10, 80 ] ]
+    pathCheck( 'iperf3', 'ping', moduleName='ccbench' )
+    if not loadVariants( variants, opts.module ):
+        return 1
+    output = open( opts.output, 'w' ) if opts.output else None
+    results = []
+    for result in ccbench( variants, rttMixes,
+                           parseList( opts.flows, int ),
+                           parseList( opts.rates ),
+                           queue=opts.queue, duration=opts.time ):
+        line = json.dumps( result, sort_keys=True )
+        print( line )
+        sys.stdout.flush()
+        if output:
+            output.write( line + '\n' )
+            output.flush()
+        results.append( result )
+    if output:
+        output.close()
+    if not opts.baseline:
+        return 0
+    with open( opts.baseline ) as f:
+        baseline = [ json.loads( line ) for line in f if line.strip() ]
+    found = regressions( results, baseline, opts.tolerance )
+    for line in found:
+        error( 'Regression: %s\n' % line )
+    return 1 if found else 0
+
+
+if __name__ == '__main__':
+    setLogLevel( 'info' )
+    sys.exit( main( sys.argv[ 1: ] ) )
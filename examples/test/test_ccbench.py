@@ -0,0 +1,60 @@
+#!/usr/bin/env python
+
+"""
+Test for ccbench.py
+"""
+
+import json
+import sys
+import unittest
+
+from mininet.examples.ccbench import jain, percentile, regressions
+from mininet.util import pexpect, quietRun
+
+
+class testCCBench( unittest.TestCase ):
+
+    def testJain( self ):
+        "Jain's index should be 1 for equal shares and 1/n for one hog"
+        self.assertAlmostEqual( jain( [ 5, 5, 5, 5 ] ), 1.0 )
+        self.assertAlmostEqual( jain( [ 8, 0, 0, 0 ] ), .25 )
+        self.assertEqual( jain( [ 0, 0 ] ), 0.0 )
+
+    def testPercentile( self ):
+        "Nearest-rank percentiles of sorted samples"
+        values = list( range( 1, 101 ) )
+        self.assertEqual( percentile( values, 50 ), 50 )
+        self.assertEqual( percentile( values, 0 ), 1 )
+        self.assertEqual( percentile( values, 99 ), 99 )
+        self.assertEqual( percentile( values, 100 ), 100 )
+        self.assertEqual( percentile( [], 50 ), None )
+
+    def testRegressions( self ):
+        "Only changes for the worse beyond tolerance should be flagged"
+        base = { 'variant': 'reno_abc', 'rate': 10, 'flows': 2,
+                 'rtts': [ 20 ], 'duration': 20, 'total': 9.0,
+                 'jain': .99, 'retransmits': 100,
+                 'qdelay': { 'p99': 40.0 } }
+        same = dict( base, total=8.5, retransmits=105 )
+        self.assertEqual( regressions( [ same ], [ base ] ), [] )
+        slower = dict( base, total=7.0, qdelay={ 'p99': 60.0 } )
+        found = regressions( [ slower ], [ base ] )
+        self.assertEqual( len( found ), 2 )
+        other = dict( slower, flows=4 )
+        self.assertEqual( regressions( [ other ], [ base ] ), [] )
+
+    @unittest.skipIf( '-quick' in sys.argv, 'long test' )
+    @unittest.skipUnless( quietRun( 'which iperf3' ), 'requires iperf3' )
+    def testRun( self ):
+        "A short reno run should report sensible results"
+        p = pexpect.spawn( 'python -m mininet.examples.ccbench -v reno '
+                           '-r 20 -n 2 -b 10 -t 5' )
+        p.expect( r'\{.*\}\r?\n', timeout=120 )
+        result = json.loads( p.match.group( 0 ) )
+        p.expect( pexpect.EOF )
+        self.assertEqual( len( result[ 'throughput' ] ), 2 )
+        self.assertTrue( 0 < result[ 'utilization' ] <= 1.1 )
+        self.assertTrue( result[ 'jain' ] > .5 )
+
+if __name__ == '__main__':
+    unittest.main()
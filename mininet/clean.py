@@ -68,7 +68,8 @@ def cleanup( cls):
         sh( 'pkill -9 -f "sudo mnexec"')
 
         info( "*** Removing junk from /tmp\n" )
-        sh( 'rm -f /tmp/vconn* /tmp/vlogs* /tmp/*.out /tmp/*.log' )
+        sh( 'rm -f /tmp/vconn* /tmp/vlogs* /tmp/*.out /tmp/*.log '
+            '/tmp/mn-*.sock' )
 
         info( "*** Removing old X11 tunnels\n" )
         cleanUpScreens()
@@ -0,0 +1,428 @@
+"""
+Python-side support for mnexec(1) modes that go beyond simple
+fork/exec of a command in a namespace.
+
+LaunchServer: a persistent 'mnexec -L' process which lives in a node's
+    namespaces (and cgroup), and starts commands sent to it over a unix
+    socket. This avoids an mnexec process, a /proc lookup and a pair of
+    setns() calls for every popen() on a node.
+
+LaunchedProcess: a Popen()-like object for a process started by a
+    LaunchServer.
+
+createNamespaces(): create many namespaces in parallel using a single
+    'mnexec -N' invocation, for nodes to attach to later.
+
+PidSocket: a socket pair over which 'mnexec -P' hands back a pidfd
+    for the process it is about to exec.
+
+PidfdTracker: signal and wait for many processes at once via their
+    pidfds and epoll, e.g. to tear down a large network quickly.
+
+ResourceMonitor: sample cgroup CPU/memory/IO and interface counters
+    of many nodes with a single 'mnexec -s' process.
+"""
+
+import json
+import os
+import signal
+import socket
+import struct
+from array import array
+from select import select, epoll, EPOLLIN
+from subprocess import Popen, PIPE, STDOUT
+from tempfile import TemporaryFile
+from time import sleep, time
+
+from mininet.log import debug, error
+from mininet.util import Python3, decode, encode
+
+
+# Must match struct launchreq and struct launchmsg in mnexec.c
+LaunchReq = struct.Struct( 'II' )
+LaunchMsg = struct.Struct( 'ii' )
+
+
+def recvPid( sock ):
+    """Receive a launchmsg from mnexec
+       returns: pid, status, pidfd (or None), or None if sock closed"""
+    fdsize = array( 'i' ).itemsize
+    # Received fds would otherwise be inheritable, and leak into any
+    # later Popen( close_fds=False )
+    data, ancdata, _flags, _addr = sock.recvmsg(
+        LaunchMsg.size, socket.CMSG_SPACE( fdsize ),
+        socket.MSG_CMSG_CLOEXEC )
+    if len( data ) < LaunchMsg.size:
+        return None
+    pid, status = LaunchMsg.unpack( data )
+    fd = None
+    for level, kind, payload in ancdata:
+        if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+            fd = array( 'i', payload[ :fdsize ] )[ 0 ]
+    return pid, status, fd
+
+
+def pidfdSignal( pid, pidfd, sig ):
+    """Signal a process, using its pidfd if we can
+       returns: False if the process has already exited"""
+    try:
+        if pidfd is not None and hasattr( signal, 'pidfd_send_signal' ):
+            signal.pidfd_send_signal( pidfd, sig )
+        else:
+            os.kill( pid, sig )
+    except ( ProcessLookupError, OSError ):
+        return False
+    return True
+
+
+class LaunchedProcess( object ):
+    """A process started by a LaunchServer, which mimics the
+       parts of the Popen() API that Mininet uses"""
+
+    def __init__( self, conn, pid, stdin=None, stdout=None, stderr=None,
+                  args=None, pidfd=None ):
+        """conn: connection to launch server (receives exit status)
+           pid: process ID
+           stdin, stdout, stderr: our ends of any pipes
+           args: command that was launched
+           pidfd: pidfd for process, if available"""
+        self.conn, self.pid, self.pidfd = conn, pid, pidfd
+        self.stdin, self.stdout, self.stderr = stdin, stdout, stderr
+        self.args = args
+        self.returncode = None
+
+    def _status( self, block=True ):
+        "Internal method: collect exit status from server"
+        if self.returncode is not None:
+            return self.returncode
+        if not block and not select( [ self.conn ], [], [], 0 )[ 0 ]:
+            return None
+        data = self.conn.recv( LaunchMsg.size )
+        self.conn.close()
+        if self.pidfd is not None:
+            os.close( self.pidfd )
+            self.pidfd = None
+        if len( data ) < LaunchMsg.size:
+            # Server went away; we can no longer tell how we exited
+            self.returncode = -1
+        else:
+            _pid, status = LaunchMsg.unpack( data )
+            if os.WIFSIGNALED( status ):
+                self.returncode = -os.WTERMSIG( status )
+            else:
+                self.returncode = os.WEXITSTATUS( status )
+        return self.returncode
+
+    def poll( self ):
+        "Return exit code, or None if still running"
+        return self._status( block=False )
+
+    def wait( self ):
+        "Wait for exit and return exit code"
+        return self._status( block=True )
+
+    def communicate( self, input=None ):  # pylint: disable=redefined-builtin
+        """Send input, read output until EOF, and wait for exit
+           returns: stdout, stderr"""
+        streams = [ f for f in ( self.stdout, self.stderr ) if f ]
+        chunks = { f: [] for f in streams }
+        readers = list( streams )
+        writers = [ self.stdin ] if self.stdin else []
+        pending = input or b''
+        if self.stdin and not pending:
+            self.stdin.close()
+            writers = []
+        while readers or writers:
+            readable, writable, _ = select( readers, writers, [] )
+            if writable:
+                count = os.write( self.stdin.fileno(), pending[ :4096 ] )
+                pending = pending[ count: ]
+                if not pending:
+                    self.stdin.close()
+                    writers = []
+            for f in readable:
+                data = os.read( f.fileno(), 4096 )
+                if data:
+                    chunks[ f ].append( data )
+                else:
+                    f.close()
+                    readers.remove( f )
+        self.wait()
+        return tuple( b''.join( chunks[ f ] ) if f else None
+                      for f in ( self.stdout, self.stderr ) )
+
+    def send_signal( self, sig ):
+        "Send signal sig to process"
+        if self.returncode is None:
+            pidfdSignal( self.pid, self.pidfd, sig )
+
+    def terminate( self ):
+        "Send SIGTERM to process"
+        self.send_signal( 15 )
+
+    def kill( self ):
+        "Send SIGKILL to process"
+        self.send_signal( 9 )
+
+
+class LaunchServer( object ):
+    "Persistent mnexec launcher in a node's namespaces"
+
+    # Popen() arguments that we know how to handle
+    supported = ( 'stdin', 'stdout', 'stderr', 'cwd', 'env' )
+
+    def __init__( self, node, mnopts=None, path=None ):
+        """node: node whose namespaces we should serve
+           mnopts: additional mnexec options, e.g. [ '-g', group ]
+           path: unix socket path (/tmp/mn-<node>-<pid>.sock)"""
+        self.node = node
+        self.path = path or '/tmp/mn-%s-%d.sock' % ( node.name, os.getpid() )
+        if os.path.exists( self.path ):
+            os.unlink( self.path )
+        # We detach using a new session rather than mnexec -d, so that
+        # our Popen() stays attached to the server process itself
+        cmd = [ 'mnexec', '-c' ]
+        if node.inNamespace:
+            cmd += [ '-a', str( node.pid ) ]
+        cmd += ( mnopts or [] ) + [ '-L', self.path ]
+        # Its output goes to a file rather than a pipe that nobody
+        # reads, which would block it once full
+        self.log = TemporaryFile()
+        # pylint: disable=protected-access
+        self.server = node._popen( cmd, stdin=PIPE, stdout=self.log,
+                                   stderr=STDOUT, start_new_session=True )
+        while not os.path.exists( self.path ):
+            if self.server.poll() is not None:
+                self.log.seek( 0 )
+                error( '*** %s: launch server failed: %s\n' % (
+                    node.name, decode( self.log.read() ) ) )
+                self.stop()
+                return
+            sleep( .001 )
+
+    @classmethod
+    def available( cls, **kwargs ):
+        "Can we handle this popen() request?"
+        return Python3 and all( k in cls.supported for k in kwargs )
+
+    def running( self ):
+        "Is our server still running?"
+        return self.server is not None and self.server.poll() is None
+
+    @staticmethod
+    def _childFd( spec, stdfd, mode ):
+        """Internal method: return ( fd for child, our end, close fd )
+           spec: PIPE, None, int fd or file object
+           stdfd: our own corresponding fd (0, 1 or 2)
+           mode: 'r' if child reads, 'w' if child writes"""
+        if spec == PIPE:
+            rfd, wfd = os.pipe()
+            if mode == 'r':
+                return rfd, os.fdopen( wfd, 'wb' ), rfd
+            return wfd, os.fdopen( rfd, 'rb' ), wfd
+        if spec is None:
+            return stdfd, None, None
+        if isinstance( spec, int ):
+            return spec, None, None
+        return spec.fileno(), None, None
+
+    def popen( self, cmd, stdin=None, stdout=None, stderr=None,
+               cwd=None, env=None ):
+        """Launch cmd in our node's namespaces
+           cmd: list of command arguments
+           stdin, stdout, stderr, cwd, env: as for Popen()
+           returns: LaunchedProcess"""
+        ends, fds, toclose = [], [], []
+        for spec, stdfd, mode in ( ( stdin, 0, 'r' ), ( stdout, 1, 'w' ),
+                                   ( stderr, 2, 'w' ) ):
+            if stdfd == 2 and spec == STDOUT:
+                fd, end, closefd = fds[ 1 ], None, None
+            else:
+                fd, end, closefd = self._childFd( spec, stdfd, mode )
+            fds.append( fd )
+            ends.append( end )
+            if closefd is not None:
+                toclose.append( closefd )
+        env = os.environ if env is None else env
+        strings = ( [ cwd or os.getcwd() ] + [ str( c ) for c in cmd ] +
+                    [ '%s=%s' % item for item in env.items() ] )
+        payload = ( LaunchReq.pack( len( cmd ), len( env ) ) +
+                    b''.join( encode( s ) + b'\0' for s in strings ) )
+        conn = socket.socket( socket.AF_UNIX, socket.SOCK_SEQPACKET )
+        try:
+            conn.connect( self.path )
+            conn.sendmsg( [ payload ], [ ( socket.SOL_SOCKET,
+                                           socket.SCM_RIGHTS,
+                                           array( 'i', fds ) ) ] )
+            msg = recvPid( conn )
+        finally:
+            for fd in toclose:
+                os.close( fd )
+        pid, err, pidfd = msg or ( -1, 0, None )
+        if pid < 0:
+            conn.close()
+            raise OSError( err, '%s: could not launch %s' % (
+                self.node.name, cmd ) )
+        debug( 'launch', cmd, pid )
+        return LaunchedProcess( conn, pid, *ends, args=cmd, pidfd=pidfd )
+
+    def stop( self ):
+        "Shut down server"
+        if self.running():
+            self.server.kill()
+        if self.server:
+            # Reap server and close its pipes
+            self.server.communicate()
+        self.server = None
+        if self.log:
+            self.log.close()
+            self.log = None
+        if os.path.exists( self.path ):
+            os.unlink( self.path )
+
+
+class PidSocket( object ):
+    """Socket pair for receiving a pidfd from mnexec -P
+       usage: ps = PidSocket(); Popen( ps.mnopts() + ..., pass_fds=... );
+              ps.receive()"""
+
+    supported = Python3
+
+    def __init__( self ):
+        self.sock, self.child = socket.socketpair( socket.AF_UNIX,
+                                                   socket.SOCK_SEQPACKET )
+        self.child.set_inheritable( True )
+
+    def mnopts( self ):
+        "mnexec options to send pidfd to us"
+        return [ '-P', str( self.child.fileno() ) ]
+
+    def receive( self ):
+        """Wait for mnexec to exec (or exit)
+           returns: pid, pidfd (either may be None)"""
+        self.child.close()
+        msg = recvPid( self.sock )
+        self.sock.close()
+        if not msg:
+            return None, None
+        pid, _status, pidfd = msg
+        return pid, pidfd
+
+
+class PidfdTracker( object ):
+    "Signal and wait for a set of processes, using pidfds and epoll"
+
+    def __init__( self ):
+        self.pids = {}  # pidfd -> pid
+        self.epoll = None
+
+    def add( self, pid, pidfd ):
+        "Track process pid with (our own copy of) pidfd"
+        self.pids[ os.dup( pidfd ) ] = pid
+
+    def signal( self, sig ):
+        "Send sig to all remaining processes"
+        for pidfd, pid in self.pids.items():
+            pidfdSignal( pid, pidfd, sig )
+
+    def wait( self, timeout=None ):
+        """Wait for processes to exit
+           timeout: maximum seconds to wait, or None to wait forever
+           returns: list of pids that are still running"""
+        if self.epoll is None:
+            self.epoll = epoll()
+            for pidfd in self.pids:
+                self.epoll.register( pidfd, EPOLLIN )
+        end = None if timeout is None else time() + timeout
+        while self.pids:
+            remaining = -1 if end is None else max( end - time(), 0 )
+            events = self.epoll.poll( remaining )
+            if not events:
+                break
+            for pidfd, _event in events:
+                # pidfds become readable when their process exits
+                self.epoll.unregister( pidfd )
+                os.close( pidfd )
+                del self.pids[ pidfd ]
+        return list( self.pids.values() )
+
+    def close( self ):
+        "Stop tracking processes"
+        for pidfd in self.pids:
+            os.close( pidfd )
+        self.pids = {}
+        if self.epoll:
+            self.epoll.close()
+            self.epoll = None
+
+
+def createNamespaces( count, jobs=None ):
+    """Create network and mount namespaces in parallel
+       count: number of namespaces to create
+       jobs: number of parallel mnexec workers (default: #cpus)
+       returns: list of holder pids, or None for failed namespaces"""
+    if count <= 0:
+        return []
+    cmd = [ 'mnexec' ]
+    if jobs:
+        cmd += [ '-j', str( jobs ) ]
+    cmd += [ '-N', str( count ) ]
+    popen = Popen(  # pylint: disable=consider-using-with
+        cmd, stdout=PIPE, stderr=PIPE )
+    out, err = popen.communicate()
+    if popen.returncode:
+        error( '*** createNamespaces: %s' % decode( err ) )
+    pids = [ None ] * count
+    for line in decode( out ).splitlines():
+        index, pid = [ int( field ) for field in line.split() ]
+        if pid > 0:
+            pids[ index ] = pid
+    return pids
+
+
+class ResourceMonitor( object ):
+    """Sample resource usage of many nodes periodically using a single
+       'mnexec -s' process, which re-reads each node's cgroup and
+       /proc/<pid>/net/dev files rather than spawning a command per node.
+       Each sample is a dict with keys t (time), node (name), and,
+       if available, cpu (ns), mem, rd, wr (bytes) and net
+       ({ intf: [ rxbytes, rxpackets, txbytes, txpackets ] })."""
+
+    def __init__( self, nodes, interval=.1, count=None ):
+        """nodes: nodes to sample
+           interval: sampling interval in seconds (default: .1)
+           count: number of samples, or None to run until stop()"""
+        cmd = [ 'mnexec' ]
+        if count:
+            cmd += [ '-S', str( count ) ]
+        cmd += [ '-s', str( max( 1, int( interval * 1000 ) ) ) ]
+        cmd += [ self.spec( node ) for node in nodes ]
+        self.popen = Popen(  # pylint: disable=consider-using-with
+            cmd, stdout=PIPE )
+
+    @staticmethod
+    def spec( node ):
+        "mnexec -s argument for node: name:pid[:cgroup]"
+        group = node.name if getattr( node, 'cgroupsInited', False ) else ''
+        return '%s:%d:%s' % ( node.name, node.pid, group )
+
+    def samples( self ):
+        "Generator: yield samples as they arrive"
+        for line in self.popen.stdout:
+            yield json.loads( decode( line ) )
+
+    def stop( self ):
+        "Stop sampling"
+        if self.popen.poll() is None:
+            self.popen.terminate()
+        self.popen.communicate()
+
+
+def sampleResources( nodes ):
+    """Take a single resource sample of nodes
+       returns: { node name: sample } (see ResourceMonitor)"""
+    monitor = ResourceMonitor( nodes, count=1 )
+    result = dict( ( sample[ 'node' ], sample )
+                   for sample in monitor.samples() )
+    monitor.stop()
+    return result
@@ -99,9 +99,10 @@
 
 from mininet.cli import CLI
 from mininet.log import info, error, output, warn, debug
-from mininet.node import ( Node, Host, OVSKernelSwitch, DefaultController,
-                           Controller )
+from mininet.node import ( Node, Host, CPULimitedHost, OVSKernelSwitch,
+                           DefaultController, Controller )
 from mininet.nodelib import NAT
+from mininet.mnexec import createNamespaces, PidfdTracker
 from mininet.link import Link, Intf
 from mininet.util import ( quietRun, fixLimits, numCores, ensureRoot,
                            macColonHex, ipStr, ipParse, netParse, ipAdd,
@@ -120,7 +121,8 @@ def __init__( self, topo=None, switch=OVSKernelSwitch, host=Host,
                   build=True, xterms=False, cleanup=False, ipBase='10.0.0.0/8',
                   inNamespace=False,
                   autoSetMacs=False, autoStaticArp=False, autoPinCpus=False,
-                  listenPort=None, waitConnected=False ):
+                  listenPort=None, waitConnected=False,
+                  batchNamespaces=False ):
         """Create Mininet object.
            topo: Topo (topology) object or None
            switch: default Switch class
@@ -136,10 +138,14 @@ def __init__( self, topo=None, switch=OVSKernelSwitch, host=Host,
            autoSetMacs: set MAC addrs automatically like IP addresses?
            autoStaticArp: set all-pairs static MAC addrs?
            autoPinCpus: pin hosts to (real) cores (requires CPULimitedHost)?
+               True: assign cpusets round-robin; 'pack' or 'spread': pin
+               with CPU affinity and NUMA policy (see CPULimitedHost)
            listenPort: base listening port to open; will be incremented for
                each additional switch in the net if inNamespace=False
            waitConnected: wait for switches to Connect?
-               (False; True/None=wait indefinitely; time(s)=timed wait)"""
+               (False; True/None=wait indefinitely; time(s)=timed wait)
+           batchNamespaces: create host namespaces in parallel with a
+               single mnexec -N before starting host shells?"""
         self.topo = topo
         self.switch = switch
         self.host = host
@@ -161,6 +167,7 @@ def __init__( self, topo=None, switch=OVSKernelSwitch, host=Host,
         self.nextCore = 0  # next core for pinning hosts to CPUs
         self.listenPort = listenPort
         self.waitConn = waitConnected
+        self.batchNamespaces = batchNamespaces
 
         self.hosts = []
         self.switches = []
@@ -222,7 +229,11 @@ def addHost( self, name, cls=None, **params ):
                                   '/%s' % self.prefixLen }
         if self.autoSetMacs:
             defaults[ 'mac' ] = macColonHex( self.nextIP )
-        if self.autoPinCpus:
+        if self.autoPinCpus in ( 'pack', 'spread' ):
+            defaults.update( CPULimitedHost.placement( self.nextCore,
+                                                       self.autoPinCpus ) )
+            self.nextCore += 1
+        elif self.autoPinCpus:
             defaults[ 'cores' ] = self.nextCore
             self.nextCore = ( self.nextCore + 1 ) % self.numCores
         self.nextIP += 1
@@ -474,9 +485,19 @@ def buildFromTopo( self, topo=None ):
                 else:
                     self.addController( 'c%d' % i, cls )
 
+        nsPids = {}
+        if self.batchNamespaces:
+            names = [ h for h in topo.hosts()
+                      if topo.nodeInfo( h ).get( 'inNamespace', True ) ]
+            info( '*** Creating %d host namespaces\n' % len( names ) )
+            nsPids = dict( zip( names, createNamespaces( len( names ) ) ) )
+
         info( '*** Adding hosts:\n' )
         for hostName in topo.hosts():
-            self.addHost( hostName, **topo.nodeInfo( hostName ) )
+            params = topo.nodeInfo( hostName )
+            if nsPids.get( hostName ):
+                params = dict( params, nsPid=nsPids[ hostName ] )
+            self.addHost( hostName, **params )
             info( hostName + ' ' )
 
         info( '\n*** Adding switches:\n' )
@@ -597,14 +618,36 @@ def stop( self ):
             info( switch.name + ' ' )
             if switch not in stopped:
                 switch.stop()
+        self.hangupShells( self.switches )
+        for switch in self.switches:
             switch.terminate()
         info( '\n' )
         info( '*** Stopping %i hosts\n' % len( self.hosts ) )
+        self.hangupShells( self.hosts )
         for host in self.hosts:
             info( host.name + ' ' )
             host.terminate()
         info( '\n*** Done\n' )
 
+    @staticmethod
+    def hangupShells( nodes, timeout=1 ):
+        """Hang up node shells all at once and wait for them to exit
+           using their pidfds, rather than one node at a time
+           nodes: nodes to hang up
+           timeout: seconds to wait before resorting to SIGKILL"""
+        tracker = PidfdTracker()
+        for node in nodes:
+            # Nodes with private dirs need their shells to unmount them
+            if ( node.pidfd is None or node.privateDirs or not node.shell
+                 or node.shell.poll() is not None ):
+                continue
+            os.killpg( node.shell.pid, signal.SIGHUP )
+            tracker.add( node.shell.pid, node.pidfd )
+        if tracker.wait( timeout ):
+            tracker.signal( signal.SIGKILL )
+            tracker.wait()
+        tracker.close()
+
     def run( self, test, *args, **kwargs ):
         "Perform a complete start/test/stop cycle."
         self.start()
@@ -58,7 +58,7 @@
 import signal
 import select
 from re import findall
-from subprocess import Popen, PIPE
+from subprocess import Popen, PIPE, STDOUT
 from sys import exit  # pylint: disable=redefined-builtin
 from time import sleep
 
@@ -66,8 +66,9 @@
 from mininet.util import ( quietRun, errRun, errFail, moveIntf, isShellBuiltin,
                            numCores, retry, mountCgroups, BaseString, decode,
                            encode, getincrementaldecoder, Python3, which,
-                           StrictVersion )
+                           StrictVersion, numaNodes )
 from mininet.moduledeps import moduleDeps, pathCheck, TUN
+from mininet.mnexec import LaunchServer, PidSocket
 from mininet.link import Link, Intf, TCIntf, OVSIntf
 
 
@@ -84,6 +85,10 @@ def __init__( self, name, inNamespace=True, **params ):
         """name: name of node
            inNamespace: in network namespace?
            privateDirs: list of private directory strings or tuples
+           launcher: use a persistent mnexec launch server for popen()
+           nsPid: pid holding namespaces to attach to (see mnexec -N)
+           holder: hold namespaces with mnexec -H rather than a bash
+             shell, and run each cmd() in a fresh bash via popen()
            params: Node parameters (see config() for details)"""
 
         # Make sure class actually works
@@ -96,6 +101,21 @@ def __init__( self, name, inNamespace=True, **params ):
         # Python 3 complains if we don't wait for shell exit
         self.waitExited = params.get( 'waitExited', Python3 )
 
+        # Optional mnexec launch server for popen() (see mininet.mnexec)
+        self.launcher = params.get( 'launcher', False )
+        self.launchServer = None
+
+        # Namespaces created for us in advance, if any
+        self.nsPid = params.get( 'nsPid', None )
+
+        # pidfd for our shell, if mnexec and the kernel support it
+        self.pidfd = None
+
+        # Optional shell-less mode: our "shell" is an mnexec -H holder
+        self.holder = params.get( 'holder', False )
+        self.cmdPopen = None
+        self.cmdGroups = []
+
         # Stash configuration parameters for future reference
         self.params = params
 
@@ -146,14 +166,38 @@ def startShell( self, mnopts=None ):
         # mnexec: (c)lose descriptors, (d)etach from tty,
         # (p)rint pid, and run in (n)amespace
         opts = '-cd' if mnopts is None else mnopts
-        if self.inNamespace:
+        nsargs = []
+        if self.inNamespace and self.nsPid:
+            # (a)ttach to namespaces that were created for us
+            opts += 'a'
+            nsargs = [ str( self.nsPid ) ]
+        elif self.inNamespace:
             opts += 'n'
         # bash -i: force interactive
         # -s: pass $* to shell, and make process easy to find in ps
         # prompt is set to sentinel chr( 127 )
-        cmd = [ 'mnexec', opts, 'env', 'PS1=' + chr( 127 ),
-                'bash', '--norc', '--noediting',
-                '-is', 'mininet:' + self.name ]
+        # mnexec -P: hand back a pidfd for the shell
+        pidsock = PidSocket() if PidSocket.supported else None
+        mnopts = pidsock.mnopts() if pidsock else []
+        if self.holder:
+            # mnexec -H: just hold our namespaces open
+            cmd = [ 'mnexec' ] + mnopts + [ opts ] + nsargs + [ '-H' ]
+            with open( os.devnull, 'r+' ) as devnull:
+                self.shell = self._popen( cmd, stdin=devnull, stdout=devnull,
+                                          stderr=devnull, close_fds=False )
+            if pidsock:
+                _pid, self.pidfd = pidsock.receive()
+            self.pid = self.shell.pid
+            self.execed = False
+            self.lastCmd = None
+            self.lastPid = None
+            self.readbuf = ''
+            self.waiting = False
+            return
+        cmd = ( [ 'mnexec' ] + mnopts + [ opts ] + nsargs +
+                [ 'env', 'PS1=' + chr( 127 ),
+                  'bash', '--norc', '--noediting',
+                  '-is', 'mininet:' + self.name ] )
 
         # Spawn a shell subprocess in a pseudo-tty, to disable buffering
         # in the subprocess and insulate it from signals (e.g. SIGINT)
@@ -161,6 +205,8 @@ def startShell( self, mnopts=None ):
         self.master, self.slave = pty.openpty()
         self.shell = self._popen( cmd, stdin=self.slave, stdout=self.slave,
                                   stderr=self.slave, close_fds=False )
+        if pidsock:
+            _pid, self.pidfd = pidsock.receive()
         # XXX BL: This doesn't seem right, and we should also probably
         # close our files when we exit...
         self.stdin = os.fdopen( self.master, 'r' )
@@ -230,13 +276,21 @@ def cleanup( self ):
         # for intfName in self.intfNames():
         # if self.name in intfName:
         # quietRun( 'ip link del ' + intfName )
-        if self.shell:
+        if self.shell and self.holder:
+            self.closeCmd()
+            if self.waitExited:
+                debug( 'waiting for', self.pid, 'to terminate\n' )
+                self.shell.wait()
+        elif self.shell:
             # Close ptys
             self.stdin.close()
             os.close(self.slave)
             if self.waitExited:
                 debug( 'waiting for', self.pid, 'to terminate\n' )
                 self.shell.wait()
+        if self.pidfd is not None:
+            os.close( self.pidfd )
+            self.pidfd = None
         self.shell = None
 
     # Subshell I/O, commands and control
@@ -275,9 +329,24 @@ def write( self, data ):
     def terminate( self ):
         "Send kill signal to Node and clean up after it."
         self.unmountPrivateDirs()
+        self.stopLaunchServer()
         if self.shell:
             if self.shell.poll() is None:
                 os.killpg( self.shell.pid, signal.SIGHUP )
+        for pgid in self.cmdGroups:
+            # Background commands started in holder mode
+            try:
+                os.killpg( pgid, signal.SIGHUP )
+            except OSError:
+                pass
+        self.cmdGroups = []
+        if self.nsPid:
+            # Release our namespace holder
+            try:
+                os.kill( self.nsPid, signal.SIGKILL )
+            except OSError:
+                pass
+            self.nsPid = None
         self.cleanup()
 
     def stop( self, deleteIntfs=False ):
@@ -315,6 +384,9 @@ def sendCmd( self, *args, **kwargs ):
             # Replace empty commands with something harmless
             cmd = 'echo -n'
         self.lastCmd = cmd
+        if self.holder:
+            self.sendHolderCmd( cmd, printPid )
+            return
         # if a builtin command is backgrounded, it still yields a PID
         if len( cmd ) > 0 and cmd[ -1 ] == '&':
             # print ^A{pid}\n so monitor() can set lastPid
@@ -325,8 +397,55 @@ def sendCmd( self, *args, **kwargs ):
         self.lastPid = None
         self.waiting = True
 
+    def sendHolderCmd( self, cmd, printPid=False ):
+        """Holder mode: run cmd in a fresh bash in our namespace.
+           cmd: command string
+           printPid: print command's PID? (False)
+           Each command gets its own bash, so shell state (cd, variables,
+           jobs) does not carry over between commands, and the output of
+           backgrounded commands is discarded unless redirected."""
+        background = cmd[ -1 ] == '&'
+        if background:
+            # Detach the job from our pipe and report its pid
+            cmd = ( 'exec 3>&1 >/dev/null 2>&1\n'
+                    '{ %s\n} 3>&- &\n'
+                    'printf "\\001%%d\\n" $! >&3' % cmd[ :-1 ] )
+        elif printPid and not isShellBuiltin( cmd ):
+            cmd = 'mnexec -p ' + cmd
+        self.cmdPopen = self.popen( [ 'bash', '-c', cmd ], stdin=PIPE,
+                                    stdout=PIPE, stderr=STDOUT )
+        if background:
+            # Each command leads its own process group (mnexec -d),
+            # so remember it in order to clean up the job on terminate()
+            self.cmdGroups.append( self.cmdPopen.pid )
+        self.stdin, self.stdout = self.cmdPopen.stdin, self.cmdPopen.stdout
+        self.pollOut = select.poll()
+        self.pollOut.register( self.stdout )
+        self.outToNode[ self.stdout.fileno() ] = self
+        self.inToNode[ self.stdin.fileno() ] = self
+        self.lastPid = None
+        self.waiting = True
+
+    def closeCmd( self ):
+        "Holder mode: close and reap the current command"
+        popen = self.cmdPopen
+        if not popen:
+            return
+        self.outToNode.pop( popen.stdout.fileno(), None )
+        self.inToNode.pop( popen.stdin.fileno(), None )
+        popen.stdin.close()
+        popen.stdout.close()
+        popen.wait()
+        self.cmdPopen = None
+        self.stdin = self.stdout = None
+        self.waiting = False
+
     def sendInt( self, intr=chr( 3 ) ):
         "Interrupt running command."
+        if self.holder:
+            if self.cmdPopen and intr == chr( 3 ):
+                os.killpg( self.cmdPopen.pid, signal.SIGINT )
+            return
         debug( 'sendInt: writing chr(%d)\n' % ord( intr ) )
         self.write( intr )
 
@@ -335,6 +454,8 @@ def monitor( self, timeoutms=None, findPid=True ):
            Set self.waiting to False if command has completed.
            timeoutms: timeout in ms or None to wait indefinitely
            findPid: look for PID from mnexec -p"""
+        if self.holder:
+            return self.monitorHolder( timeoutms, findPid )
         ready = self.waitReadable( timeoutms )
         if not ready:
             return ''
@@ -362,6 +483,32 @@ def monitor( self, timeoutms=None, findPid=True ):
             data = data.replace( chr( 127 ), '' )
         return data
 
+    def monitorHolder( self, timeoutms=None, findPid=True ):
+        """Holder mode monitor(): completion is signaled by EOF
+           on the command's output rather than by a sentinel."""
+        if not self.cmdPopen:
+            self.waiting = False
+            return ''
+        if not self.pollOut.poll( timeoutms ):
+            return ''
+        data = os.read( self.stdout.fileno(), 1024 )
+        if not data:
+            self.closeCmd()
+            return ''
+        data = self.decoder.decode( data )
+        marker = chr( 1 ) + r'\d+\n'
+        while findPid and chr( 1 ) in data and not re.findall( marker, data ):
+            # Marker can be read in chunks; continue until all of it is read
+            more = os.read( self.stdout.fileno(), 1024 )
+            if not more:
+                break
+            data += self.decoder.decode( more )
+        markers = re.findall( marker, data ) if findPid else []
+        if markers:
+            self.lastPid = int( markers[ 0 ][ 1: ] )
+            data = re.sub( marker, '', data )
+        return data
+
     def waitOutput( self, verbose=False, findPid=True ):
         """Wait for a command to complete.
            Completion is signaled by a sentinel character, ASCII(127)
@@ -398,9 +545,7 @@ def popen( self, *args, **kwargs ):
         """Return a Popen() object in our namespace
            args: Popen() args, single list, or string
            kwargs: Popen() keyword args"""
-        defaults = { 'stdout': PIPE, 'stderr': PIPE,
-                     'mncmd':
-                     [ 'mnexec', '-da', str( self.pid ) ] }
+        defaults = { 'stdout': PIPE, 'stderr': PIPE }
         defaults.update( kwargs )
         shell = defaults.pop( 'shell', False )
         if len( args ) == 1:
@@ -417,11 +562,54 @@ def popen( self, *args, **kwargs ):
             cmd = list( args )
         if shell:
             cmd = [ os.environ[ 'SHELL' ], '-c' ] + [ ' '.join( cmd ) ]
-        # Attach to our namespace  using mnexec -a
-        cmd = defaults.pop( 'mncmd' ) + cmd
+        mncmd = defaults.pop( 'mncmd', None )
+        # Use our launch server if we have one and it can handle this
+        if ( self.launcher and mncmd is None and
+             LaunchServer.available( **defaults ) ):
+            server = self.startLaunchServer()
+            if server:
+                return server.popen( cmd, **defaults )
+        if mncmd is None:
+            mncmd = self.popenCmd()
+        # Attach to our namespace using mnexec -a or -F
+        if '-F' in mncmd:
+            defaults[ 'pass_fds' ] = ( tuple( defaults.get( 'pass_fds', () ) )
+                                       + ( self.pidfd, ) )
+        cmd = mncmd + cmd
         popen = self._popen( cmd, **defaults )
         return popen
 
+    def attachOpts( self ):
+        """mnexec options to attach to our namespaces: via our shell's
+           pidfd if we have one (no /proc lookup), else via our pid"""
+        if self.pidfd is not None:
+            return [ '-F', str( self.pidfd ) ]
+        return [ '-a', str( self.pid ) ]
+
+    def popenCmd( self ):
+        """mnexec command to run popen() commands in our namespace,
+           when not using our launch server (override)"""
+        return [ 'mnexec', '-d' ] + self.attachOpts()
+
+    def launcherOpts( self ):
+        "Additional mnexec options for our launch server (override)"
+        assert self
+        return []
+
+    def startLaunchServer( self ):
+        """Start our launch server if it isn't already running
+           returns: LaunchServer or None"""
+        if not ( self.launchServer and self.launchServer.running() ):
+            self.launchServer = LaunchServer( self,
+                                              mnopts=self.launcherOpts() )
+        return self.launchServer if self.launchServer.running() else None
+
+    def stopLaunchServer( self ):
+        "Stop our launch server, if any"
+        if self.launchServer:
+            self.launchServer.stop()
+            self.launchServer = None
+
     def pexec( self, *args, **kwargs ):
         """Execute a command using popen
            returns: out, err, exitcode"""
@@ -695,6 +883,7 @@ def __init__( self, name, sched='cfs', **params ):
         self.sched = sched
         self.cgroupsInited = False
         self.cgroup, self.rtprio = None, None
+        self.affinity, self.numa = None, None
 
     def initCgroups( self ):
         "Deferred cgroup initialization"
@@ -704,14 +893,21 @@ def initCgroups( self ):
         if not CPULimitedHost.inited:
             CPULimitedHost.init()
         # Create a cgroup and move shell into it
-        self.cgroup = 'cpu,cpuacct,cpuset:/' + self.name
+        # (cgroup2 has no separate cpuacct controller)
+        controllers = ( 'cpu,cpuacct' if self.cgversion == 'cgroup'
+                        else 'cpu' )
+        self.cgroup = '%s,cpuset:/%s' % ( controllers, self.name )
         errFail( 'cgcreate -g ' + self.cgroup )
         # We don't add ourselves to a cpuset because you must
         # specify the cpu and memory placement first
-        errFail( 'cgclassify -g cpu,cpuacct:/%s %s' % ( self.name, self.pid ) )
+        errFail( 'cgclassify -g %s:/%s %s' % (
+            controllers, self.name, self.pid ) )
         if self.sched == 'rt':
             self.checkRtGroupSched()
             self.rtprio = 20
+        self.cgroupsInited = True
+        # Restart any launch server in our new cgroup
+        self.stopLaunchServer()
 
     def cgroupSet( self, param, value, resource='cpu' ):
         "Set a cgroup parameter and return its value"
@@ -738,22 +934,51 @@ def cgroupDel( self ):
         # deletes the group; next attempt will give "no such file"
         return exitcode == 0 or ( 'no such file' in _err.lower() )
 
-    def popen( self, *args, **kwargs ):
-        """Return a Popen() object in node's namespace
-           args: Popen() args, single list, or string
-           kwargs: Popen() keyword args"""
-        # Tell mnexec to execute command in our cgroup
-        mncmd = kwargs.pop( 'mncmd', [ 'mnexec', '-g', self.name,
-                                       '-da', str( self.pid ) ] )
+    def rtOpts( self ):
+        "Return mnexec options for RT scheduling, if possible"
         # if our cgroup is not given any cpu time,
         # we cannot assign the RR Scheduler.
         if self.sched == 'rt':
             if int( self.cgroupGet( 'rt_runtime_us', 'cpu' ) ) <= 0:
-                mncmd += [ '-r', str( self.rtprio ) ]
+                return [ '-r', str( self.rtprio ) ]
             else:
                 debug( '*** error: not enough cpu time available for %s.' %
                        self.name, 'Using cfs scheduler for subprocess\n' )
-        return Host.popen( self, *args, mncmd=mncmd, **kwargs )
+        return []
+
+    def placementOpts( self ):
+        "Return mnexec options for CPU affinity and NUMA memory policy"
+        opts = []
+        if self.affinity is not None:
+            opts += [ '-A', self.affinity ]
+        if self.numa is not None:
+            opts += [ '-m', self.numa ]
+        return opts
+
+    def launcherOpts( self ):
+        """Launch commands in our cgroup once it exists; on cgroup2,
+           children are created directly in the cgroup (mnexec -C)
+           so the server itself is not charged to us"""
+        if not self.cgroupsInited:
+            return self.placementOpts()
+        if self.cgversion == 'cgroup2':
+            return [ '-C', self.name ] + self.placementOpts()
+        return [ '-g', self.name ] + self.rtOpts() + self.placementOpts()
+
+    def popenCmd( self ):
+        """Tell mnexec to execute command in our cgroup; used whenever
+           popen() cannot use our launch server, which is in it already"""
+        return ( [ 'mnexec', '-g', self.name, '-d' ] + self.attachOpts() +
+                 self.rtOpts() + self.placementOpts() )
+
+    def popen( self, *args, **kwargs ):
+        """Return a Popen() object in node's namespace
+           args: Popen() args, single list, or string
+           kwargs: Popen() keyword args"""
+        if 'mncmd' in kwargs:
+            kwargs[ 'mncmd' ] = ( kwargs[ 'mncmd' ] + self.rtOpts() +
+                                  self.placementOpts() )
+        return Host.popen( self, *args, **kwargs )
 
     def cleanup( self ):
         "Clean up Node, then clean up our cgroup"
@@ -864,10 +1089,51 @@ def setCPUs( self, cores, mems=0 ):
         errFail( 'cgclassify -g cpuset:/%s %s' % (
                  self.name, self.pid ) )
 
+    def setAffinity( self, cores ):
+        """Pin our shell and processes to (real) cores using
+           sched_setaffinity rather than a cpuset
+           cores: core, list of cores, or string such as '0-3,8'"""
+        if isinstance( cores, list ):
+            cores = ','.join( [ str( c ) for c in cores ] )
+        self.affinity = str( cores )
+        # Commands run via cmd() inherit the shell's affinity
+        quietRun( 'taskset -pc %s %s' % ( self.affinity, self.pid ) )
+        self.stopLaunchServer()
+        return self.affinity
+
+    def setNuma( self, policy ):
+        """Set NUMA memory policy for processes started by popen()
+           policy: [bind:|interleave:|preferred:]nodes, e.g. '0'"""
+        self.numa = str( policy )
+        self.stopLaunchServer()
+        return self.numa
+
+    @classmethod
+    def placement( cls, index, policy='spread' ):
+        """Return deterministic affinity and numa parameters for the
+           index'th host
+           policy: 'pack' to fill each NUMA node's cores in turn, or
+                   'spread' to alternate hosts between NUMA nodes"""
+        nodes = numaNodes()
+        numbers = sorted( nodes )
+        if policy == 'pack':
+            cores = [ ( n, c ) for n in numbers for c in nodes[ n ] ]
+            node, core = cores[ index % len( cores ) ]
+        elif policy == 'spread':
+            node = numbers[ index % len( numbers ) ]
+            cores = nodes[ node ]
+            core = cores[ ( index // len( numbers ) ) % len( cores ) ]
+        else:
+            raise Exception( 'Unknown placement policy %s' % policy )
+        return { 'affinity': core, 'numa': str( node ) }
+
     # pylint: disable=arguments-differ
-    def config( self, cpu=-1, cores=None, **params ):
+    def config( self, cpu=-1, cores=None, affinity=None, numa=None,
+                **params ):
         """cpu: desired overall system CPU fraction
            cores: (real) core(s) this host can run on
+           affinity: (real) core(s) to pin our processes to
+           numa: NUMA memory policy for our processes (see setNuma())
            params: parameters for Node.config()"""
         r = Node.config( self, **params )
         self.initCgroups()
@@ -875,6 +1141,11 @@ def config( self, cpu=-1, cores=None, **params ):
         # that seems redundant
         self.setParam( r, 'setCPUFrac', cpu=cpu )
         self.setParam( r, 'setCPUs', cores=cores )
+        # setParam() would spread a list of cores over setAffinity() args
+        if isinstance( affinity, list ):
+            affinity = [ affinity ]
+        self.setParam( r, 'setAffinity', affinity=affinity )
+        self.setParam( r, 'setNuma', numa=numa )
         return r
 
     inited = False
@@ -0,0 +1,152 @@
+#!/usr/bin/env python
+
+"""Package: mininet
+   Test mnexec modes and their support in mininet.mnexec."""
+
+import os
+import signal
+import unittest
+from subprocess import PIPE, STDOUT
+
+from mininet.mnexec import createNamespaces, sampleResources
+from mininet.net import Mininet
+from mininet.node import Host
+from mininet.topo import SingleSwitchTopo
+from mininet.util import Python3, custom, quietRun
+from mininet.clean import cleanup
+
+
+@unittest.skipUnless( Python3, 'launch server requires Python 3' )
+class testLaunchServer( unittest.TestCase ):
+    "Test popen() via a persistent mnexec launch server"
+
+    def setUp( self ):
+        host = custom( Host, launcher=True )
+        self.net = Mininet( SingleSwitchTopo(), host=host )
+        self.net.start()
+
+    def tearDown( self ):
+        self.net.stop()
+        cleanup()
+
+    def testNamespace( self ):
+        "Launched commands should see the node's interfaces"
+        h1 = self.net[ 'h1' ]
+        out, _err, code = h1.pexec( 'ip link show' )
+        self.assertEqual( code, 0 )
+        self.assertIn( 'h1-eth0', out )
+        self.assertTrue( h1.launchServer.running() )
+
+    def testStdio( self ):
+        "Pipes, stderr redirection and exit codes should work"
+        h1 = self.net[ 'h1' ]
+        popen = h1.popen( [ 'sh', '-c', 'cat; echo err >&2; exit 3' ],
+                          stdin=PIPE, stdout=PIPE, stderr=STDOUT )
+        out, _err = popen.communicate( b'hello\n' )
+        self.assertEqual( out, b'hello\nerr\n' )
+        self.assertEqual( popen.returncode, 3 )
+
+    def testPing( self ):
+        "Ping between hosts using launched processes"
+        h1, h2 = self.net[ 'h1' ], self.net[ 'h2' ]
+        _out, _err, code = h1.pexec( 'ping', '-c1', h2.IP() )
+        self.assertEqual( code, 0 )
+
+
+@unittest.skipUnless( Python3, 'pidfd handback requires Python 3' )
+class testPidfd( unittest.TestCase ):
+    "Test pidfd handback from mnexec -P and pidfd-based teardown"
+
+    @staticmethod
+    def tearDown():
+        cleanup()
+
+    def testTeardown( self ):
+        "Shells should have pidfds and be gone after stop()"
+        net = Mininet( SingleSwitchTopo( k=4 ) )
+        net.start()
+        shells = [ h.shell.pid for h in net.hosts ]
+        if any( h.pidfd is None for h in net.hosts ):
+            net.stop()
+            self.skipTest( 'kernel does not support pidfd_open' )
+        net.stop()
+        for pid in shells:
+            self.assertFalse( os.path.exists( '/proc/%d' % pid ) )
+
+
+class testBatchNamespaces( unittest.TestCase ):
+    "Test host namespaces created in batch by mnexec -N"
+
+    @staticmethod
+    def tearDown():
+        cleanup()
+
+    def testCreate( self ):
+        "Namespaces should be distinct from ours and each other"
+        pids = createNamespaces( 4 )
+        self.assertTrue( all( pids ) )
+        namespaces = set( os.readlink( '/proc/%d/ns/net' % pid )
+                          for pid in pids )
+        namespaces.add( os.readlink( '/proc/self/ns/net' ) )
+        self.assertEqual( len( namespaces ), 5 )
+        for pid in pids:
+            os.kill( pid, signal.SIGKILL )
+
+    def testPing( self ):
+        "Ping test with batch namespace creation"
+        mn = Mininet( SingleSwitchTopo( k=4 ), batchNamespaces=True )
+        dropped = mn.run( mn.ping )
+        self.assertEqual( dropped, 0 )
+
+
+class testHolder( unittest.TestCase ):
+    "Test shell-less nodes held by mnexec -H"
+
+    def setUp( self ):
+        self.net = Mininet( controller=None,
+                            host=custom( Host, holder=True ) )
+        h1, h2 = self.net.addHost( 'h1' ), self.net.addHost( 'h2' )
+        self.net.addLink( h1, h2 )
+        self.net.start()
+
+    def tearDown( self ):
+        self.net.stop()
+        cleanup()
+
+    def testCmd( self ):
+        "cmd() should run in the node's namespace without a bash shell"
+        h1 = self.net[ 'h1' ]
+        self.assertNotIn( 'bash', quietRun( 'ps -o args= -p %d' % h1.pid ) )
+        self.assertIn( 'h1-eth0', h1.cmd( 'ip link show; echo err >&2' ) )
+        self.assertIn( 'err', h1.cmd( 'echo err >&2' ) )
+
+    def testBackground( self ):
+        "Backgrounded commands should report their pid and not block"
+        h1 = self.net[ 'h1' ]
+        h1.cmd( 'sleep 100 &' )
+        self.assertTrue( h1.lastPid )
+        self.assertTrue( os.path.exists( '/proc/%d' % h1.lastPid ) )
+
+
+class testResourceMonitor( unittest.TestCase ):
+    "Test per-node resource sampling via mnexec -s"
+
+    @staticmethod
+    def tearDown():
+        cleanup()
+
+    def testSample( self ):
+        "Samples should report each node's own interfaces"
+        net = Mininet( controller=None )
+        h1, h2 = net.addHost( 'h1' ), net.addHost( 'h2' )
+        net.addLink( h1, h2 )
+        net.start()
+        samples = sampleResources( net.hosts )
+        net.stop()
+        self.assertEqual( sorted( samples ), [ 'h1', 'h2' ] )
+        self.assertEqual( list( samples[ 'h1' ][ 'net' ] ), [ 'h1-eth0' ] )
+        self.assertEqual( len( samples[ 'h2' ][ 'net' ][ 'h2-eth0' ] ), 4 )
+
+
+if __name__ == '__main__':
+    unittest.main()
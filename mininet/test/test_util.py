@@ -5,7 +5,7 @@
 
 import unittest
 
-from mininet.util import quietRun
+from mininet.util import quietRun, parseCpuList
 
 class testQuietRun( unittest.TestCase ):
     """Test quietRun that runs a command and returns its merged output from
@@ -36,5 +36,18 @@ def testMultipleReads( self ):
             self.assertEqual( n, len( output ) )
 
 
+class testParseCpuList( unittest.TestCase ):
+    "Test parsing of sysfs/cpuset style cpu lists"
+
+    def testList( self ):
+        "Parse single cores and ranges"
+        self.assertEqual( parseCpuList( '0-3,8,10-11\n' ),
+                          [ 0, 1, 2, 3, 8, 10, 11 ] )
+
+    def testEmpty( self ):
+        "An empty list has no cores"
+        self.assertEqual( parseCpuList( '' ), [] )
+
+
 if __name__ == "__main__":
     unittest.main()
@@ -590,6 +590,34 @@ def numCores():
         return 0
     return numCores.ncores
 
+def parseCpuList( cpulist ):
+    "Parse a list such as 0-3,8 into a list of numbers"
+    result = []
+    for item in cpulist.strip().split( ',' ):
+        if '-' in item:
+            first, last = item.split( '-' )
+            result += range( int( first ), int( last ) + 1 )
+        elif item:
+            result.append( int( item ) )
+    return result
+
+def numaNodes():
+    """Returns dict of NUMA node number to list of its cores, or a
+       single node 0 containing all cores if we can't find NUMA info"""
+    if hasattr( numaNodes, 'nodes' ):
+        return numaNodes.nodes
+    nodes = {}
+    sysdir = '/sys/devices/system/node'
+    for name in os.listdir( sysdir ) if os.path.isdir( sysdir ) else []:
+        if not re.match( r'node\d+$', name ):
+            continue
+        with open( os.path.join( sysdir, name, 'cpulist' ) ) as f:
+            cores = parseCpuList( f.read() )
+        if cores:
+            nodes[ int( name[ 4: ] ) ] = cores
+    numaNodes.nodes = nodes or { 0: list( range( numCores() ) ) }
+    return numaNodes.nodes
+
 def irange(start, end):
     """Inclusive range from start to end (vs. Python insanity.)
        irange(1,5) -> 1, 2, 3, 4, 5"""
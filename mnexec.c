@@ -6,9 +6,18 @@
  *  - closing all file descriptors except stdin/out/error
  *  - detaching from a controlling tty using setsid
  *  - running in network and mount namespaces
- *  - printing out the pid of a process so we can identify it later
- *  - attaching to a namespace and cgroup
+ *  - printing out the pid of a process so we can identify it later,
+ *    or handing back a pidfd for it over a unix socket
+ *  - attaching to a namespace and cgroup (v1 or v2)
+ *  - configuring cgroup parameters
  *  - setting RT scheduling
+ *  - setting CPU affinity and NUMA memory policy
+ *  - creating many namespaces in parallel
+ *  - holding a namespace open without running a shell in it
+ *  - sampling cgroup and network counters for many nodes at once
+ *  - timing each setup phase, for benchmarking
+ *  - serving launch requests on a unix socket, so that commands
+ *    can be started in a node's namespaces without re-attaching
  *
  * Partially based on public domain setsid(1)
 */
@@ -26,7 +35,20 @@
 #include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/statfs.h>
+#include <sys/resource.h>
+#include <linux/magic.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #if !defined(VERSION)
 #define VERSION "(devel)"
@@ -35,25 +57,280 @@
 void usage(char *name)
 {
     printf("Execution utility for Mininet\n\n"
-           "Usage: %s [-cdnp] [-a pid] [-g group] [-r rtprio] cmd args...\n\n"
+           "Usage: %s [-cdnpt] [-P fd] [-a pid] [-g group] [-w file=value]\n"
+           "       [-r rtprio] [-A cpus] [-m policy] cmd args...\n"
+           "       %s [-cdn] [-a pid] [-g group] [-C group] -L socket\n"
+           "       %s [-cdn] [-P fd] [-a pid] -H\n"
+           "       %s [-S count] -s interval name:pid[:group]...\n"
+           "       %s [-j jobs] -N count\n\n"
            "Options:\n"
            "  -c: close all file descriptors except stdin/out/error\n"
            "  -d: detach from tty by calling setsid()\n"
            "  -n: run in new network and mount namespaces\n"
            "  -p: print ^A + pid\n"
+           "  -P fd: send pid and pidfd over unix socket fd before exec\n"
            "  -a pid: attach to pid's network and mount namespaces\n"
-           "  -g group: add to cgroup\n"
+           "  -a path: attach to namespace file, e.g. /run/netns/name\n"
+           "  -F fd: attach via inherited pidfd or namespace fd\n"
+           "  -g group: add to cgroup (v1 or v2)\n"
+           "  -C group: create -L children in cgroup (v2, using clone3)\n"
+           "  -w file=value: set cgroup parameter for -g/-C group,\n"
+           "     e.g. cpu.max='50000 100000' or cpuset.cpus=0-3\n"
            "  -r rtprio: run with SCHED_RR (usually requires -g)\n"
+           "  -A cpus: set CPU affinity, e.g. 0-3,8\n"
+           "  -m [bind:|interleave:|preferred:]nodes: set NUMA memory policy\n"
+           "  -L socket: serve launch requests on unix socket\n"
+           "  -H: hold namespaces open (pause) instead of running cmd\n"
+           "  -N count: create count namespaces, print index and pid of each\n"
+           "  -j jobs: number of parallel workers for -N (default: #cpus)\n"
+           "  -s ms: print JSON resource samples for nodes every ms\n"
+           "  -S count: stop -s after count samples\n"
+           "  -t: print setup phase times on stderr before exec\n"
            "  -v: print version\n",
-           name);
+           name, name, name, name, name);
 }
 
 
+/* Phase timing
+ *
+ * With -t (which should come first), we time each phase of our
+ * setup and, just before exec, print a line such as
+ *
+ *   mnexec-time close=ns unshare=ns remount=ns sysfs=ns exec=t
+ *
+ * on stderr, where exec is CLOCK_MONOTONIC at the time of exec, so
+ * that the exec'd program (e.g. mnexec-bench) can time the exec too.
+ */
+
+#define MAXMARKS 16
+
+static int timing;
+static long long lastmark;
+static struct { const char *phase; long long ns; } marks[MAXMARKS];
+static int nmarks;
+
+long long monotonic(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Record the time since the previous mark as phase */
+void mark(const char *phase)
+{
+    long long now;
+    if (!timing)
+        return;
+    now = monotonic();
+    if (nmarks < MAXMARKS) {
+        marks[nmarks].phase = phase;
+        marks[nmarks++].ns = now - lastmark;
+    }
+    lastmark = monotonic();
+}
+
+void printmarks(void)
+{
+    int i;
+    if (!timing)
+        return;
+    fprintf(stderr, "mnexec-time");
+    for (i = 0; i < nmarks; i++)
+        fprintf(stderr, " %s=%lld", marks[i].phase, marks[i].ns);
+    fprintf(stderr, " exec=%lld\n", monotonic());
+}
+
 int setns(int fd, int nstype)
 {
     return syscall(__NR_setns, fd, nstype);
 }
 
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
+/* Return a pidfd for pid (Linux 5.3+), or -1 */
+int pidfd(pid_t pid)
+{
+    return pid > 0 ? syscall(__NR_pidfd_open, pid, 0) : -1;
+}
+
+/* Namespace attachment
+ *
+ * Plan A: setns() on a pidfd attaches to the network and mount
+ * namespaces in one atomic call (Linux 5.8+).
+ * Plan B: open /proc/<pid>/ns/{net,mnt} and setns() to each.
+ * Plan C: if we can't enter the mount namespace, chroot into
+ * /proc/<pid>/root instead.
+ *
+ * We can also attach using a pre-opened pidfd or namespace fd (-F),
+ * or a namespace file such as a /run/netns bind mount, so callers
+ * that already hold one can skip the /proc lookup entirely.
+ * Namespace fds are never leaked into the exec'd program.
+ */
+
+int attachpid(pid_t pid);
+
+/* Return the pid that pidfd fd refers to, from /proc/self/fdinfo,
+   or -1 if fd is not a pidfd */
+pid_t fdpid(int fd)
+{
+    char path[PATH_MAX], line[256];
+    pid_t pid = -1;
+    FILE *f;
+
+    snprintf(path, PATH_MAX, "/proc/self/fdinfo/%d", fd);
+    f = fopen(path, "re");
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "Pid: %d", &pid) == 1)
+            break;
+    fclose(f);
+    return pid;
+}
+
+/* Attach to fd's namespaces: both if it is a pidfd, else just the
+   namespace it refers to; closes fd and returns 0 or -1.
+   Before Linux 5.8, setns() takes no pidfds; we then attach to the
+   pid it refers to (Plan B) */
+int attachfd(int fd)
+{
+    int result = setns(fd, CLONE_NEWNET|CLONE_NEWNS);
+    pid_t pid;
+
+    if (result != 0 && errno == EINVAL) {
+        pid = fdpid(fd);
+        if (pid > 0) {
+            close(fd);
+            return attachpid(pid);
+        }
+        result = setns(fd, 0);
+    }
+    if (result != 0)
+        perror("setns");
+    close(fd);
+    return result;
+}
+
+/* Attach to the namespace in file path, e.g. /run/netns/h1 */
+int attachpath(char *path)
+{
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    return attachfd(fd);
+}
+
+/* Attach to pid's network and mount namespaces */
+int attachpid(pid_t pid)
+{
+    char path[PATH_MAX];
+    int fd = pidfd(pid), result;
+
+    /* Plan A: both at once via pidfd */
+    if (fd >= 0) {
+        result = setns(fd, CLONE_NEWNET|CLONE_NEWNS);
+        close(fd);
+        if (result == 0)
+            return 0;
+    }
+    /* Plan B: one at a time via /proc */
+    snprintf(path, PATH_MAX, "/proc/%d/ns/net", pid);
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    result = setns(fd, 0);
+    close(fd);
+    if (result != 0) {
+        perror("setns");
+        return -1;
+    }
+    snprintf(path, PATH_MAX, "/proc/%d/ns/mnt", pid);
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+    result = fd < 0 ? -1 : setns(fd, 0);
+    if (fd >= 0)
+        close(fd);
+    if (result != 0) {
+        /* Plan C: chroot/chdir into pid's root file system */
+        snprintf(path, PATH_MAX, "/proc/%d/root", pid);
+        if (chroot(path) < 0) {
+            perror(path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#ifndef __NR_close_range
+#define __NR_close_range 436
+#endif
+
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Close all file descriptors except stdin/out/error
+ *
+ * Plan A: close_range() closes everything in one call (Linux 5.9+).
+ * Marking descriptors close-on-exec would not do, as -L and -H go on
+ * without exec.
+ * Plan B: read /proc/self/fd with raw getdents64(), closing only
+ * descriptors that are actually open.
+ * Plan C: close every possible descriptor, which is slow when the
+ * fd limit is large.
+ *
+ * Build with -DNO_CLOSE_RANGE to force plan B (for benchmarking).
+ * If keep is above 2, it is left open (for -P).
+ */
+void closefds(int keep)
+{
+    static char buf[4096];
+    struct linux_dirent64 *de;
+    long n, pos;
+    int dirfd, fd;
+    char *s;
+
+#ifndef NO_CLOSE_RANGE
+    if (keep < 3 &&
+        syscall(__NR_close_range, 3, ~0U, 0) == 0)
+        return;
+    if (keep >= 3 &&
+        (keep == 3 ||
+         syscall(__NR_close_range, 3, keep - 1, 0) == 0) &&
+        syscall(__NR_close_range, keep + 1, ~0U, 0) == 0)
+        return;
+#endif
+    dirfd = open("/proc/self/fd", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (dirfd < 0) {
+        for (fd = getdtablesize(); fd > 2; fd--)
+            if (fd != keep)
+                close(fd);
+        return;
+    }
+    while ((n = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0)
+        for (pos = 0; pos < n; pos += de->d_reclen) {
+            de = (struct linux_dirent64 *)(buf + pos);
+            /* skip . and .. */
+            if (!isdigit(de->d_name[0]))
+                continue;
+            for (fd = 0, s = de->d_name; *s; s++)
+                fd = fd * 10 + *s - '0';
+            if (fd > 2 && fd != dirfd && fd != keep)
+                close(fd);
+        }
+    close(dirfd);
+}
+
 /* Validate alphanumeric path foo1/bar2/baz */
 void validate(char *path)
 {
@@ -66,27 +343,62 @@ void validate(char *path)
     }
 }
 
-/* Add our pid to cgroup */
-void cgroup(char *gname)
+/* cgroup support
+ *
+ * On a cgroup v2 (unified) hierarchy, attaching is a single write
+ * to /sys/fs/cgroup/<group>/cgroup.procs; on v1 we write our pid to
+ * the tasks file of each of the cpu, cpuacct and cpuset hierarchies.
+ * For the launch server, -C opens a v2 group once and children are
+ * created directly inside it using clone3(CLONE_INTO_CGROUP).
+ */
+
+#define CGROOT "/sys/fs/cgroup"
+
+/* Are we on a cgroup v2 only (unified) hierarchy? */
+int cgroup2(void)
+{
+    static int unified = -1;
+    struct statfs fs;
+    if (unified < 0)
+        unified = statfs(CGROOT, &fs) == 0 &&
+                  fs.f_type == CGROUP2_SUPER_MAGIC;
+    return unified;
+}
+
+/* Write a string to a file with a single write(); returns 0 or -1 */
+int writefile(char *path, char *value)
+{
+    int fd = open(path, O_WRONLY|O_CLOEXEC);
+    ssize_t len = strlen(value);
+    int ok;
+    if (fd < 0)
+        return -1;
+    ok = write(fd, value, len) == len;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+/* Add pid to cgroup */
+void cgroupattach(char *gname, pid_t pid)
 {
     static char path[PATH_MAX];
     static char *groups[] = {
         "cpu", "cpuacct", "cpuset", NULL
     };
-    char **gptr;
-    pid_t pid = getpid();
+    char **gptr, spid[16];
     int count = 0;
     validate(gname);
-    for (gptr = groups; *gptr; gptr++) {
-        FILE *f;
-        snprintf(path, PATH_MAX, "/sys/fs/cgroup/%s/%s/tasks",
-                 *gptr, gname);
-        f = fopen(path, "w");
-        if (f) {
+    snprintf(spid, sizeof(spid), "%d\n", pid);
+    if (cgroup2()) {
+        snprintf(path, PATH_MAX, CGROOT "/%s", gname);
+        mkdir(path, 0755);
+        snprintf(path, PATH_MAX, CGROOT "/%s/cgroup.procs", gname);
+        count = writefile(path, spid) == 0;
+    }
+    else for (gptr = groups; *gptr; gptr++) {
+        snprintf(path, PATH_MAX, CGROOT "/%s/%s/tasks", *gptr, gname);
+        if (writefile(path, spid) == 0)
             count++;
-            fprintf(f, "%d\n", pid);
-            fclose(f);
-        }
     }
     if (!count) {
         fprintf(stderr, "cgroup: could not add to cgroup %s\n",
@@ -95,30 +407,801 @@ void cgroup(char *gname)
     }
 }
 
+/* Add our pid to cgroup */
+void cgroup(char *gname)
+{
+    cgroupattach(gname, getpid());
+}
+
+#ifndef __NR_clone3
+#define __NR_clone3 435
+#endif
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+/* clone3() arguments, as of Linux 5.7 */
+struct cloneargs {
+    uint64_t flags;
+    uint64_t pidfd;
+    uint64_t child_tid;
+    uint64_t parent_tid;
+    uint64_t exit_signal;
+    uint64_t stack;
+    uint64_t stack_size;
+    uint64_t tls;
+    uint64_t set_tid;
+    uint64_t set_tid_size;
+    uint64_t cgroup;
+};
+
+/* cgroup for children of the launch server (-C) */
+static char *cgname;
+static int cgfd = -1;
+
+/* fork(), creating the child in our -C cgroup if we have one */
+pid_t spawn(void)
+{
+    struct cloneargs args;
+    pid_t pid;
+    if (cgfd < 0)
+        return fork();
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_INTO_CGROUP;
+    args.exit_signal = SIGCHLD;
+    args.cgroup = cgfd;
+    pid = syscall(__NR_clone3, &args, sizeof(args));
+    if (pid >= 0 || (errno != ENOSYS && errno != E2BIG && errno != EINVAL))
+        return pid;
+    /* Older kernel: the child has to join the cgroup itself */
+    pid = fork();
+    if (pid == 0)
+        cgroup(cgname);
+    return pid;
+}
+
+/* Open a v2 cgroup directory for clone3(CLONE_INTO_CGROUP) */
+int cgroupopen(char *gname)
+{
+    static char path[PATH_MAX];
+    int fd;
+    validate(gname);
+    if (!cgroup2()) {
+        fprintf(stderr, "cgroup: -C requires cgroup v2\n");
+        exit(1);
+    }
+    snprintf(path, PATH_MAX, CGROOT "/%s", gname);
+    mkdir(path, 0755);
+    fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    return fd;
+}
+
+/* Set a cgroup control file, e.g. cpu.max=50000 100000 or
+   cpuset.cpus=0-3; on v1 the controller is the prefix of the name */
+void cgroupset(char *gname, char *setting)
+{
+    static char path[PATH_MAX];
+    char *value = strchr(setting, '='), *dot = strchr(setting, '.'), *s;
+    if (!gname || !value || !dot || dot > value) {
+        fprintf(stderr, "cgroup: invalid setting %s\n", setting);
+        exit(1);
+    }
+    *value++ = 0;
+    for (s = setting; *s; s++)
+        if (!isalnum(*s) && *s != '.' && *s != '_') {
+            fprintf(stderr, "cgroup: invalid setting %s\n", setting);
+            exit(1);
+        }
+    if (cgroup2())
+        snprintf(path, PATH_MAX, CGROOT "/%s/%s", gname, setting);
+    else
+        snprintf(path, PATH_MAX, CGROOT "/%.*s/%s/%s",
+                 (int)(dot - setting), setting, gname, setting);
+    if (writefile(path, value) != 0) {
+        perror(path);
+        exit(1);
+    }
+}
+
+/* CPU and NUMA placement */
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#endif
+
+#define MAXBITS 4096
+#define LONGBITS (8 * sizeof(unsigned long))
+
+/* Parse a list such as 0-3,8,10-11 into bitmap; returns 0 or -1 */
+int parselist(char *list, unsigned long *bitmap)
+{
+    char *s = list, *end;
+    long first, last;
+    memset(bitmap, 0, MAXBITS / 8);
+    while (*s) {
+        first = last = strtol(s, &end, 10);
+        if (end == s)
+            return -1;
+        if (*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s)
+                return -1;
+        }
+        if (first < 0 || last < first || last >= MAXBITS)
+            return -1;
+        for (; first <= last; first++)
+            bitmap[first / LONGBITS] |= 1UL << (first % LONGBITS);
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        s = end;
+    }
+    return 0;
+}
+
+/* Pin ourselves to cpus in list */
+int affinity(char *list)
+{
+    static unsigned long bitmap[MAXBITS / LONGBITS];
+    cpu_set_t *set;
+    size_t size = CPU_ALLOC_SIZE(MAXBITS);
+    int cpu, result;
+    if (parselist(list, bitmap) != 0) {
+        fprintf(stderr, "invalid cpu list: %s\n", list);
+        return -1;
+    }
+    set = CPU_ALLOC(MAXBITS);
+    CPU_ZERO_S(size, set);
+    for (cpu = 0; cpu < MAXBITS; cpu++)
+        if (bitmap[cpu / LONGBITS] & (1UL << (cpu % LONGBITS)))
+            CPU_SET_S(cpu, size, set);
+    result = sched_setaffinity(0, size, set);
+    CPU_FREE(set);
+    if (result != 0)
+        perror("sched_setaffinity");
+    return result;
+}
+
+/* Set our memory policy from [bind:|interleave:|preferred:]nodes */
+int mempolicy(char *policy)
+{
+    static unsigned long bitmap[MAXBITS / LONGBITS];
+    char *nodes = strchr(policy, ':');
+    int mode = MPOL_BIND;
+    if (nodes) {
+        *nodes++ = 0;
+        if (!strcmp(policy, "interleave"))
+            mode = MPOL_INTERLEAVE;
+        else if (!strcmp(policy, "preferred"))
+            mode = MPOL_PREFERRED;
+        else if (strcmp(policy, "bind"))
+            nodes = NULL;
+    }
+    else
+        nodes = policy;
+    if (!nodes || parselist(nodes, bitmap) != 0) {
+        fprintf(stderr, "invalid memory policy: %s\n", policy);
+        return -1;
+    }
+    if (syscall(__NR_set_mempolicy, mode, bitmap, MAXBITS + 1) != 0) {
+        perror("set_mempolicy");
+        return -1;
+    }
+    return 0;
+}
+
+/* Create new network and mount namespaces for ourselves */
+int newns(void)
+{
+    if (unshare(CLONE_NEWNET|CLONE_NEWNS) == -1) {
+        perror("unshare");
+        return -1;
+    }
+    mark("unshare");
+
+    /* Mark our whole hierarchy recursively as private, so that our
+     * mounts do not propagate to other processes.
+     */
+
+    if (mount("none", "/", NULL, MS_REC|MS_PRIVATE, NULL) == -1) {
+        perror("remount");
+        return -1;
+    }
+    mark("remount");
+
+    /* mount sysfs to pick up the new network namespace */
+    if (mount("sysfs", "/sys", "sysfs", MS_MGC_VAL, NULL) == -1) {
+        perror("mount");
+        return -1;
+    }
+    mark("sysfs");
+    return 0;
+}
+
+/* Detach from our caller and hold our namespaces until killed */
+void hold(void)
+{
+    int fd = open("/dev/null", O_RDWR);
+    if (fd >= 0) {
+        dup2(fd, 0);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        if (fd > 2)
+            close(fd);
+    }
+    setsid();
+    for (;;)
+        pause();
+}
+
+/* Batch namespace creation
+ *
+ * With -N count, we fork a pool of workers which create count
+ * namespaces in parallel, each held open by a detached holder
+ * process. As each namespace becomes ready we print "index pid"
+ * (or "index -1" on failure) on stdout, so that the caller can
+ * collect every namespace from a single pipe and attach to them
+ * later using -a pid.
+ */
+int batch(int count, int jobs)
+{
+    int worker, index, status, failed = 0;
+    char ready;
+    int fds[2];
+    pid_t pid;
+
+    if (jobs <= 0)
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs > count)
+        jobs = count;
+    fflush(stdout);
+    for (worker = 0; worker < jobs; worker++) {
+        pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid > 0)
+            continue;
+        /* worker: create every jobs'th namespace */
+        for (index = worker; index < count; index += jobs) {
+            if (pipe(fds) != 0) {
+                perror("pipe");
+                _exit(1);
+            }
+            pid = fork();
+            if (pid == 0) {
+                /* holder */
+                close(fds[0]);
+                if (newns() != 0)
+                    _exit(1);
+                printf("%d %d\n", index, getpid());
+                fflush(stdout);
+                ready = 1;
+                if (write(fds[1], &ready, 1) != 1)
+                    _exit(1);
+                close(fds[1]);
+                hold();
+            }
+            close(fds[1]);
+            /* Wait until the holder is ready (or dead) */
+            if (pid < 0 || read(fds[0], &ready, 1) != 1) {
+                printf("%d -1\n", index);
+                fflush(stdout);
+                failed = 1;
+            }
+            close(fds[0]);
+        }
+        _exit(failed);
+    }
+    while (wait(&status) > 0)
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            failed = 1;
+    return failed;
+}
+
+/* Resource accounting
+ *
+ * With -s interval, we sample every node given on the command line,
+ * as name:pid or name:pid:group, every interval ms and print one
+ * JSON line per node per sample:
+ *
+ *   {"t":secs,"node":name,"cpu":ns,"mem":bytes,"rd":bytes,"wr":bytes,
+ *    "net":{intf:[rxbytes,rxpackets,txbytes,txpackets],...}}
+ *
+ * cpu/mem/rd/wr come from the node's cgroup (v1 or v2) and are left
+ * out if it has none; net is /proc/<pid>/net/dev, i.e. as seen from
+ * the node's network namespace. Every file is opened once and re-read
+ * with pread(), so a sample of all nodes costs no process creation
+ * or path lookup. -S count stops after count samples.
+ */
+
+#define STATBUF (64 * 1024)
+
+struct statnode {
+    char *name;
+    int net, cpu, mem, io;
+};
+
+/* Re-read a proc or cgroup file from the start; returns length or -1 */
+ssize_t reread(int fd, char *buf, size_t size)
+{
+    ssize_t len = 0, n = 0;
+    if (fd < 0)
+        return -1;
+    while ((size_t)len < size - 1 &&
+           (n = pread(fd, buf + len, size - 1 - len, len)) > 0)
+        len += n;
+    if (n < 0 && len == 0)
+        return -1;
+    buf[len] = 0;
+    return len;
+}
+
+int statfile(char *fmt, char *a, char *b)
+{
+    static char path[PATH_MAX];
+    snprintf(path, PATH_MAX, fmt, a, b);
+    return open(path, O_RDONLY|O_CLOEXEC);
+}
+
+/* Parse name:pid[:group] and open its files */
+void statopen(struct statnode *node, char *spec)
+{
+    char *pid = strchr(spec, ':'), *group = NULL;
+    node->name = spec;
+    node->net = node->cpu = node->mem = node->io = -1;
+    if (!pid) {
+        fprintf(stderr, "stats: expected name:pid[:group], got %s\n", spec);
+        exit(1);
+    }
+    *pid++ = 0;
+    group = strchr(pid, ':');
+    if (group)
+        *group++ = 0;
+    node->net = statfile("/proc/%s/net/%s", pid, "dev");
+    if (!group || !*group)
+        return;
+    validate(group);
+    if (cgroup2()) {
+        node->cpu = statfile(CGROOT "/%s/%s", group, "cpu.stat");
+        node->mem = statfile(CGROOT "/%s/%s", group, "memory.current");
+        node->io = statfile(CGROOT "/%s/%s", group, "io.stat");
+    }
+    else {
+        node->cpu = statfile(CGROOT "/cpuacct/%s/%s", group,
+                             "cpuacct.usage");
+        node->mem = statfile(CGROOT "/memory/%s/%s", group,
+                             "memory.usage_in_bytes");
+        node->io = statfile(CGROOT "/blkio/%s/%s", group,
+                            "blkio.throttle.io_service_bytes");
+    }
+}
+
+/* Print a string as a JSON string */
+void jsonstr(char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            putchar('\\');
+        if ((unsigned char)*s >= ' ')
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+/* Print cgroup CPU time, memory and IO counters */
+void statcgroup(struct statnode *node, char *buf)
+{
+    unsigned long long rd = 0, wr = 0, n;
+    char *s, op[8];
+    if (reread(node->cpu, buf, STATBUF) > 0) {
+        if (cgroup2()) {
+            s = strstr(buf, "usage_usec ");
+            if (s)
+                printf(",\"cpu\":%llu",
+                       strtoull(s + 11, NULL, 10) * 1000);
+        }
+        else
+            printf(",\"cpu\":%llu", strtoull(buf, NULL, 10));
+    }
+    if (reread(node->mem, buf, STATBUF) > 0)
+        printf(",\"mem\":%llu", strtoull(buf, NULL, 10));
+    if (reread(node->io, buf, STATBUF) < 0)
+        return;
+    /* v2: "maj:min rbytes=N wbytes=N ..."; v1: "maj:min Read N" */
+    for (s = buf; s; s = strpbrk(s, " \n"), s = s ? s + 1 : NULL) {
+        if (!strncmp(s, "rbytes=", 7))
+            rd += strtoull(s + 7, NULL, 10);
+        else if (!strncmp(s, "wbytes=", 7))
+            wr += strtoull(s + 7, NULL, 10);
+        else if (sscanf(s, "%*u:%*u %7s %llu", op, &n) == 2) {
+            if (!strcmp(op, "Read"))
+                rd += n;
+            else if (!strcmp(op, "Write"))
+                wr += n;
+        }
+    }
+    printf(",\"rd\":%llu,\"wr\":%llu", rd, wr);
+}
+
+/* Print /proc/net/dev counters, skipping the two header lines and lo */
+void statnet(struct statnode *node, char *buf)
+{
+    unsigned long long rxb, rxp, txb, txp;
+    char *line, *colon, *name;
+    int first = 1;
+    if (reread(node->net, buf, STATBUF) < 0)
+        return;
+    line = strchr(buf, '\n');
+    line = line ? strchr(line + 1, '\n') : NULL;
+    printf(",\"net\":{");
+    for (; line && *++line; line = strchr(line, '\n')) {
+        colon = strchr(line, ':');
+        if (!colon)
+            break;
+        *colon = 0;
+        for (name = line; *name == ' '; name++)
+            ;
+        if (sscanf(colon + 1, "%llu %llu %*u %*u %*u %*u %*u %*u %llu %llu",
+                   &rxb, &rxp, &txb, &txp) != 4 || !strcmp(name, "lo")) {
+            line = colon + 1;
+            continue;
+        }
+        if (!first)
+            putchar(',');
+        first = 0;
+        jsonstr(name);
+        printf(":[%llu,%llu,%llu,%llu]", rxb, rxp, txb, txp);
+        line = colon + 1;
+    }
+    putchar('}');
+}
+
+int stats(int interval, int count, int nodes, char *specs[])
+{
+    static char buf[STATBUF];
+    struct statnode *node = calloc(nodes, sizeof(*node));
+    struct timespec next, now;
+    struct rlimit limit;
+    int i, sample;
+
+    if (interval <= 0 || nodes <= 0 || !node) {
+        fprintf(stderr, "stats: expected -s interval name:pid[:group]...\n");
+        return 1;
+    }
+    /* We keep up to four files open per node */
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    for (i = 0; i < nodes; i++)
+        statopen(&node[i], specs[i]);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (sample = 0; !count || sample < count; sample++) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        for (i = 0; i < nodes; i++) {
+            printf("{\"t\":%ld.%06ld,\"node\":", (long)now.tv_sec,
+                   now.tv_nsec / 1000);
+            jsonstr(node[i].name);
+            statcgroup(&node[i], buf);
+            statnet(&node[i], buf);
+            printf("}\n");
+        }
+        /* One write per sample; stop if our reader has gone away */
+        if (fflush(stdout) != 0)
+            return 1;
+        next.tv_sec += interval / 1000;
+        next.tv_nsec += (interval % 1000) * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        if (!count || sample + 1 < count)
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                   &next, NULL) == EINTR)
+                ;
+    }
+    return 0;
+}
+
+/* Launch server
+ *
+ * With -L, rather than exec'ing a single command, we stay in our
+ * (already attached) namespaces and cgroup and listen on a unix
+ * SOCK_SEQPACKET socket. Each connection carries one request:
+ *
+ *   struct launchreq, then NUL-terminated cwd, argv[] and envp[]
+ *   with up to three fds (stdin/out/err) attached as SCM_RIGHTS
+ *
+ * We fork and exec the command, reply with a struct launchmsg
+ * containing its pid (plus a pidfd for it, if the kernel supports
+ * them), or -1 and the errno if it could not be started (e.g. ENOENT),
+ * and send a second launchmsg with its wait()
+ * status when it exits. Children simply inherit our namespaces, so
+ * there is no /proc lookup or setns() per command.
+ */
+
+#define LAUNCH_MAX (256 * 1024)
+
+struct launchreq {
+    uint32_t argc;
+    uint32_t envc;
+};
+
+struct launchmsg {
+    int32_t pid;
+    int32_t status;
+};
+
+struct launched {
+    pid_t pid;
+    int conn;
+};
+
+static struct launched *launched;
+static int nlaunched, maxlaunched;
+
+/* Send a launchmsg, with fd attached if it is valid, ignoring
+   clients which have gone away */
+void reply(int conn, pid_t pid, int status, int fd)
+{
+    struct launchmsg msg = { pid, status };
+    struct iovec iov = { &msg, sizeof(msg) };
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr mh = { 0 };
+    struct cmsghdr *cm;
+
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (fd >= 0) {
+        mh.msg_control = cbuf;
+        mh.msg_controllen = sizeof(cbuf);
+        cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+    sendmsg(conn, &mh, MSG_NOSIGNAL);
+}
+
+/* Hand our pid and a pidfd for ourselves to whoever holds the other
+   end of unix socket sock, so that they can wait for and signal us
+   without racing against pid reuse */
+void sendpidfd(int sock)
+{
+    int fd = pidfd(getpid());
+    reply(sock, getpid(), 0, fd);
+    if (fd >= 0)
+        close(fd);
+    close(sock);
+}
+
+/* Split count NUL-terminated strings from buf into a NULL-terminated
+   vector, returning the position after the last string or NULL */
+char *unpack(char *buf, char *end, char **vec, uint32_t count)
+{
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        char *nul = memchr(buf, 0, end - buf);
+        if (!nul)
+            return NULL;
+        vec[i] = buf;
+        buf = nul + 1;
+    }
+    vec[count] = NULL;
+    return buf;
+}
+
+/* Handle a single launch request on conn; returns child pid or -1 */
+pid_t launch(int conn, sigset_t *oldmask)
+{
+    static char buf[LAUNCH_MAX];
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { buf, sizeof(buf) - 1 };
+    struct msghdr mh = { 0 };
+    struct cmsghdr *cm;
+    struct launchreq req;
+    int fds[3], nfds = 0, fd, i, err, errpipe[2];
+    char **vec = NULL, *cwd, *end, *p;
+    ssize_t len;
+    pid_t pid = -1;
+
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    len = recvmsg(conn, &mh, MSG_CMSG_CLOEXEC);
+    for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm))
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cm), nfds * sizeof(int));
+        }
+    if (len < (ssize_t)sizeof(req) || mh.msg_flags & (MSG_TRUNC|MSG_CTRUNC))
+        goto bad;
+    memcpy(&req, buf, sizeof(req));
+    if (req.argc == 0 || req.argc > LAUNCH_MAX || req.envc > LAUNCH_MAX)
+        goto bad;
+    end = buf + len;
+    *end = 0;
+    vec = malloc((req.argc + req.envc + 2) * sizeof(char *));
+    cwd = buf + sizeof(req);
+    p = memchr(cwd, 0, end - cwd);
+    if (!vec || !p || !(p = unpack(p + 1, end, vec, req.argc)) ||
+        !unpack(p, end, vec + req.argc + 1, req.envc))
+        goto bad;
+
+    /* The child reports a failed chdir() or exec over a close-on-exec
+       pipe, which we see closed without data if the exec worked */
+    if (pipe2(errpipe, O_CLOEXEC) != 0) {
+        reply(conn, -1, errno, -1);
+        goto out;
+    }
+    pid = spawn();
+    if (pid == 0) {
+        /* child: install stdio, then behave like mnexec -d */
+        sigprocmask(SIG_SETMASK, oldmask, NULL);
+        for (i = 0; i < nfds; i++)
+            dup2(fds[i], i);
+        setsid();
+        if (chdir(cwd) == 0)
+            execvpe(vec[0], vec, vec + req.argc + 1);
+        err = errno;
+        if (write(errpipe[1], &err, sizeof(err)) != sizeof(err))
+            perror("write");
+        _exit(127);
+    }
+    err = pid < 0 ? errno : 0;
+    close(errpipe[1]);
+    if (pid > 0) {
+        while ((len = read(errpipe[0], &err, sizeof(err))) < 0 &&
+               errno == EINTR)
+            ;
+        if (len == sizeof(err)) {
+            waitpid(pid, NULL, 0);
+            pid = -1;
+        }
+        else
+            err = 0;
+    }
+    close(errpipe[0]);
+    if (pid < 0) {
+        reply(conn, -1, err, -1);
+        goto out;
+    }
+    /* Our child can't be reaped (and its pid reused) until we
+       call waitpid(), so this pidfd is race-free */
+    fd = pidfd(pid);
+    reply(conn, pid, 0, fd);
+    if (fd >= 0)
+        close(fd);
+    goto out;
+bad:
+    fprintf(stderr, "mnexec: invalid launch request\n");
+    reply(conn, -1, EINVAL, -1);
+out:
+    for (i = 0; i < nfds; i++)
+        close(fds[i]);
+    free(vec);
+    return pid;
+}
+
+/* Reap exited children and report their status */
+void reap(void)
+{
+    int status, i;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        for (i = 0; i < nlaunched; i++)
+            if (launched[i].pid == pid) {
+                reply(launched[i].conn, pid, status, -1);
+                close(launched[i].conn);
+                launched[i] = launched[--nlaunched];
+                break;
+            }
+}
+
+/* Serve launch requests on unix socket path until killed */
+int serve(char *path)
+{
+    struct sockaddr_un addr;
+    struct pollfd pfd[2];
+    struct timeval tv = { 1, 0 };
+    struct signalfd_siginfo si;
+    sigset_t mask, oldmask;
+    int sock, sfd, conn;
+    pid_t pid;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    sfd = signalfd(-1, &mask, SFD_CLOEXEC|SFD_NONBLOCK);
+    sock = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+    if (sfd < 0 || sock < 0) {
+        perror("socket");
+        return 1;
+    }
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(sock, SOMAXCONN) != 0) {
+        perror(path);
+        return 1;
+    }
+    pfd[0].fd = sock;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = sfd;
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return 1;
+        }
+        if (pfd[1].revents) {
+            while (read(sfd, &si, sizeof(si)) == sizeof(si))
+                ;
+            reap();
+        }
+        if (!pfd[0].revents)
+            continue;
+        conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0)
+            continue;
+        /* Don't let a stalled client hold up everyone else */
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        pid = launch(conn, &oldmask);
+        if (pid <= 0) {
+            close(conn);
+            continue;
+        }
+        if (nlaunched == maxlaunched) {
+            maxlaunched = maxlaunched ? 2 * maxlaunched : 64;
+            launched = realloc(launched, maxlaunched * sizeof(*launched));
+            if (!launched) {
+                perror("realloc");
+                return 1;
+            }
+        }
+        launched[nlaunched].pid = pid;
+        launched[nlaunched++].conn = conn;
+    }
+}
+
 int main(int argc, char *argv[])
 {
     int c;
-    int fd;
-    DIR *dir;
-    struct dirent *de;
-    char path[PATH_MAX];
-    int nsid;
-    int pid;
+    int jobs = 0;
+    int samples = 0;
+    int pidsock = -1;
+    char *group = NULL;
     char *cwd = get_current_dir_name();
     static struct sched_param sp;
 
-    while ((c = getopt(argc, argv, "+cdnpa:g:r:vh")) != -1)
+    while ((c = getopt(argc, argv, "+cdnpa:F:g:C:w:r:A:m:P:L:HN:j:s:S:tvh")) != -1)
         switch(c) {
         case 'c':
             /* close file descriptors except stdin/out/error */
-            if ((dir = opendir("/proc/self/fd"))) {
-                while ((de = readdir(dir)))
-                    if ((fd = atoi(de->d_name)) > 2)
-                        close(fd);
-            }
-            /* fall back to old method if needed */
-            else for (fd = getdtablesize(); fd > 2; fd--)
-                     close(fd);
+            closefds(pidsock);
+            mark("close");
             break;
         case 'd':
             /* detach from tty */
@@ -137,25 +1220,8 @@ int main(int argc, char *argv[])
             break;
         case 'n':
             /* run in network and mount namespaces */
-            if (unshare(CLONE_NEWNET|CLONE_NEWNS) == -1) {
-                perror("unshare");
+            if (newns() != 0)
                 return 1;
-            }
-
-            /* Mark our whole hierarchy recursively as private, so that our
-             * mounts do not propagate to other processes.
-             */
-
-            if (mount("none", "/", NULL, MS_REC|MS_PRIVATE, NULL) == -1) {
-                perror("remount");
-                return 1;
-            }
-
-            /* mount sysfs to pick up the new network namespace */
-            if (mount("sysfs", "/sys", "sysfs", MS_MGC_VAL, NULL) == -1) {
-                perror("mount");
-                return 1;
-            }
             break;
         case 'p':
             /* print pid */
@@ -163,30 +1229,23 @@ int main(int argc, char *argv[])
             fflush(stdout);
             break;
         case 'a':
-            /* Attach to pid's network namespace and mount namespace */
-            pid = atoi(optarg);
-            sprintf(path, "/proc/%d/ns/net", pid);
-            nsid = open(path, O_RDONLY);
-            if (nsid < 0) {
-                perror(path);
+            /* Attach to pid's network namespace and mount namespace,
+               or to the namespace in a file such as /run/netns/h1 */
+            if ((optarg[0] == '/' ? attachpath(optarg) :
+                 attachpid(atoi(optarg))) != 0)
                 return 1;
-            }
-            if (setns(nsid, 0) != 0) {
-                perror("setns");
+            mark("setns");
+            /* chdir to correct working directory */
+            if (chdir(cwd) != 0) {
+                perror(cwd);
                 return 1;
             }
-            /* Plan A: call setns() to attach to mount namespace */
-            sprintf(path, "/proc/%d/ns/mnt", pid);
-            nsid = open(path, O_RDONLY);
-            if (nsid < 0 || setns(nsid, 0) != 0) {
-                /* Plan B: chroot/chdir into pid's root file system */
-                sprintf(path, "/proc/%d/root", pid);
-                if (chroot(path) < 0) {
-                    perror(path);
-                    return 1;
-                }
-            }
-            /* chdir to correct working directory */
+            break;
+        case 'F':
+            /* Attach via pre-opened pidfd or namespace fd */
+            if (attachfd(atoi(optarg)) != 0)
+                return 1;
+            mark("setns");
             if (chdir(cwd) != 0) {
                 perror(cwd);
                 return 1;
@@ -194,7 +1253,18 @@ int main(int argc, char *argv[])
             break;
         case 'g':
             /* Attach to cgroup */
-            cgroup(optarg);
+            group = optarg;
+            cgroup(group);
+            mark("cgroup");
+            break;
+        case 'C':
+            /* Launch server children are created in cgroup */
+            group = cgname = optarg;
+            cgfd = cgroupopen(cgname);
+            break;
+        case 'w':
+            /* Set cgroup parameter */
+            cgroupset(group, optarg);
             break;
         case 'r':
             /* Set RT scheduling priority */
@@ -204,6 +1274,51 @@ int main(int argc, char *argv[])
                 return 1;
             }
             break;
+        case 'P':
+            /* Send pidfd over socket before exec (or serving) */
+            pidsock = atoi(optarg);
+            break;
+        case 'L':
+            /* Serve launch requests in our namespaces */
+            if (pidsock >= 0)
+                sendpidfd(pidsock);
+            return serve(optarg);
+        case 'H':
+            /* Hold namespaces open until killed */
+            if (pidsock >= 0)
+                sendpidfd(pidsock);
+            hold();
+            return 0;
+        case 'j':
+            /* Set parallelism for -N */
+            jobs = atoi(optarg);
+            break;
+        case 'N':
+            /* Create namespaces in parallel */
+            return batch(atoi(optarg), jobs);
+        case 'S':
+            /* Set number of samples for -s */
+            samples = atoi(optarg);
+            break;
+        case 's':
+            /* Sample node resource usage */
+            return stats(atoi(optarg), samples, argc - optind,
+                         argv + optind);
+        case 'A':
+            /* Set CPU affinity */
+            if (affinity(optarg) != 0)
+                return 1;
+            break;
+        case 'm':
+            /* Set NUMA memory policy */
+            if (mempolicy(optarg) != 0)
+                return 1;
+            break;
+        case 't':
+            /* Time setup phases */
+            timing = 1;
+            lastmark = monotonic();
+            break;
         case 'v':
             printf("%s\n", VERSION);
             exit(0);
@@ -216,6 +1331,9 @@ int main(int argc, char *argv[])
         }
 
     if (optind < argc) {
+        if (pidsock >= 0)
+            sendpidfd(pidsock);
+        printmarks();
         execvp(argv[optind], &argv[optind]);
         perror(argv[optind]);
         return 1;
@@ -0,0 +1,37 @@
+/* Kernel compatibility for reno_custom.ko
+ *
+ * reno_custom.c is written against the current TCP congestion control
+ * API, and builds on Linux 5.4 and later; this fills in what older
+ * kernels lack:
+ *
+ *  5.18: tcp_snd_cwnd() and tcp_snd_cwnd_set(), which replace direct
+ *        use of tp->snd_cwnd
+ *
+ * .cong_control gained ack and flag arguments in 6.10; as that changes
+ * the hook's signature, reno_custom.c defines one of each.
+ */
+
+#ifndef _RENO_COMPAT_H
+#define _RENO_COMPAT_H
+
+#include <linux/version.h>
+#include <net/tcp.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 4, 0)
+#error "reno_custom needs Linux 5.4 or later"
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
+static inline u32 tcp_snd_cwnd(const struct tcp_sock *tp)
+{
+    return tp->snd_cwnd;
+}
+
+static inline void tcp_snd_cwnd_set(struct tcp_sock *tp, u32 val)
+{
+    WARN_ON_ONCE((int)val <= 0);
+    tp->snd_cwnd = val;
+}
+#endif
+
+#endif /* _RENO_COMPAT_H */
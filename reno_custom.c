@@ -1,91 +1,879 @@
-#include <linux/module.h>
-#include <linux/kernel.h>
-#include <net/tcp.h>
-
-void tcp_reno_init(struct sock *sk)
-{
-    /* Initialize congestion control specific variables here */
-    tcp_sk(sk)->snd_ssthresh = TCP_INFINITE_SSTHRESH; // Typically, this is a high value
-    tcp_sk(sk)->snd_cwnd = 1; // Start with a congestion window of 1
-}
-
-u32 tcp_reno_ssthresh(struct sock *sk)
-{
-    const struct tcp_sock *tp = tcp_sk(sk);
-    return max(tp->snd_cwnd >> 1U, 2U);
-}
-
-void tcp_reno_cong_avoid(struct sock *sk, u32 ack, u32 acked)
-{
-    struct tcp_sock *tp = tcp_sk(sk);
-    
-    if (!tcp_is_cwnd_limited(sk))
-        return;
-    
-    if (tp->snd_cwnd <= tp->snd_ssthresh) {
-        u32 delta = acked / tp->mss_cache;
-        if (delta == 0)
-            delta = 1;
-        
-        tp->snd_cwnd += delta;
-        
-        tp->snd_cwnd = min(tp->snd_cwnd, tp->snd_cwnd_clamp);
-    } 
-    else {
-        u32 w = tp->snd_cwnd;
-        u32 target = w * tp->mss_cache; 
-        
-        if (acked >= target) {
-            tp->snd_cwnd += acked / target;
-        } else {
-            /* In "congestion avoidance", cwnd is increased by 1 full packet
-            * per round-trip time (RTT), which is approximated here by the number of
-            * ACKed packets divided by the current congestion window. */
-            tcp_cong_avoid_ai(tp, tp->snd_cwnd, acked);
-        }
-        
-        /* Ensure that cwnd does not exceed the maximum allowed value */
-        tp->snd_cwnd = min(tp->snd_cwnd, tp->snd_cwnd_clamp);
-    }
-}
-
-u32 tcp_reno_undo_cwnd(struct sock *sk)
-{
-    /* Undo the cwnd changes during congestion avoidance if needed */
-    return tcp_sk(sk)->snd_cwnd;
-}
-
-/* This structure contains the hooks to our congestion control algorithm */
-static struct tcp_congestion_ops tcp_reno_custom = {
-    .init           = tcp_reno_init,
-    .ssthresh       = tcp_reno_ssthresh,
-    .cong_avoid     = tcp_reno_cong_avoid,
-    .undo_cwnd      = tcp_reno_undo_cwnd,  
-
-    .owner          = THIS_MODULE,
-    .name           = "reno_custom",
-};
-
-/* Initialization function of this module */
-static int __init tcp_reno_module_init(void)
-{
-    /* Register the new congestion control */
-    BUILD_BUG_ON(sizeof(struct tcp_congestion_ops) != sizeof(struct tcp_congestion_ops));
-    if (tcp_register_congestion_control(&tcp_reno_custom))
-        return -ENOBUFS;
-    return 0;
-}
-
-/* Cleanup function of this module */
-static void __exit tcp_reno_module_exit(void)
-{
-    /* Unregister the congestion control */
-    tcp_unregister_congestion_control(&tcp_reno_custom);
-}
-
-module_init(tcp_reno_module_init);
-module_exit(tcp_reno_module_exit);
-
-MODULE_AUTHOR("nethw");
-MODULE_LICENSE("GPL");
-MODULE_DESCRIPTION("TCP Reno Congestion Control");
+/* reno_custom: Reno variants for congestion control experiments
+ *
+ * One module registers every variant as its own tcp_congestion_ops,
+ * so that hosts in a single experiment can each select a different
+ * one with sysctl net.ipv4.tcp_congestion_control (which is per
+ * network namespace) without any rmmod/insmod between runs:
+ *
+ *  reno_custom   - classic Reno: one segment per ACK in slow start,
+ *                  one segment per RTT in congestion avoidance
+ *  reno_abc      - Appropriate Byte Counting (RFC 3465): cwnd grows
+ *                  by the number of bytes acknowledged rather than by
+ *                  the number of ACKs, with slow start limited to
+ *                  abc_l segments per ACK
+ *  reno_balanced - RTT-fair Reno: in congestion avoidance, cwnd grows
+ *                  by (min_rtt / base_rtt_us)^2 segments per RTT, so
+ *                  that flows get similar throughput whatever their RTT
+ *
+ * All variants can optionally leave slow start early, HyStart style
+ * (see hystart below), rather than only at the first loss, and can
+ * pace their transmissions (see pacing below), and can be driven by
+ * the kernel's delivery rate samples (see rate_sample below).
+ *
+ * Builds on Linux 5.4 and later (see reno_compat.h).
+ *
+ * Per-socket state is exported through .get_info, as INET_DIAG_VEGASINFO
+ * for ss -ti and inet_diag users (see reno_get_info), and every cwnd
+ * change hits the reno_custom:reno_cwnd tracepoint.
+ *
+ * The parameters below may be given at load time, or changed at
+ * any time in /sys/module/reno_custom/parameters/.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/inet_diag.h>
+#include <linux/reciprocal_div.h>
+#include <linux/slab.h>
+#include <net/tcp.h>
+
+#include "reno_compat.h"
+
+#define CREATE_TRACE_POINTS
+#include "reno_custom_trace.h"
+
+#define HYSTART_ACK_TRAIN   0x1
+#define HYSTART_DELAY       0x2
+
+#define HYSTART_MIN_SAMPLES 8
+#define HYSTART_DELAY_MIN   4000U   /* usec */
+#define HYSTART_DELAY_MAX   16000U  /* usec */
+
+static unsigned int hystart __read_mostly;
+module_param(hystart, uint, 0644);
+MODULE_PARM_DESC(hystart, "leave slow start early: 1 on ACK trains, "
+                 "2 on delay increase, 3 on either, 0 for never (0)");
+
+static unsigned int hystart_low_window __read_mostly = 16;
+module_param(hystart_low_window, uint, 0644);
+MODULE_PARM_DESC(hystart_low_window,
+                 "hystart: lower bound cwnd for leaving slow start (16)");
+
+static unsigned int hystart_ack_delta_us __read_mostly = 2000;
+module_param(hystart_ack_delta_us, uint, 0644);
+MODULE_PARM_DESC(hystart_ack_delta_us,
+                 "hystart: max gap between ACKs of a train in usec (2000)");
+
+static bool pacing __read_mostly;
+module_param(pacing, bool, 0444);
+MODULE_PARM_DESC(pacing, "pace transmissions at gain * cwnd / srtt, "
+                 "set at load time (0)");
+
+static unsigned int pacing_ss_gain __read_mostly = 200;
+module_param(pacing_ss_gain, uint, 0644);
+MODULE_PARM_DESC(pacing_ss_gain, "pacing: gain in slow start, percent (200)");
+
+static unsigned int pacing_ca_gain __read_mostly = 120;
+module_param(pacing_ca_gain, uint, 0644);
+MODULE_PARM_DESC(pacing_ca_gain,
+                 "pacing: gain in congestion avoidance, percent (120)");
+
+static bool rate_sample __read_mostly;
+module_param(rate_sample, bool, 0444);
+MODULE_PARM_DESC(rate_sample, "drive the variants from .cong_control rate "
+                 "samples, set at load time (0)");
+
+static unsigned int abc_l __read_mostly = 2;
+module_param(abc_l, uint, 0644);
+MODULE_PARM_DESC(abc_l,
+                 "reno_abc: max slow start growth per ACK in segments, "
+                 "0 for no limit (2)");
+
+static unsigned int base_rtt_us __read_mostly = 20000;
+module_param(base_rtt_us, uint, 0644);
+MODULE_PARM_DESC(base_rtt_us,
+                 "reno_balanced: RTT at which growth matches Reno, usec (20000)");
+
+static unsigned int fast_penalty __read_mostly = 16;
+module_param(fast_penalty, uint, 0644);
+MODULE_PARM_DESC(fast_penalty,
+                 "reno_balanced: max growth divisor below base_rtt_us (16)");
+
+static unsigned int slow_boost __read_mostly = 16;
+module_param(slow_boost, uint, 0644);
+MODULE_PARM_DESC(slow_boost,
+                 "reno_balanced: max growth multiplier above base_rtt_us (16)");
+
+static unsigned int min_rtt_win_sec __read_mostly = 10;
+module_param(min_rtt_win_sec, uint, 0644);
+MODULE_PARM_DESC(min_rtt_win_sec,
+                 "reno_balanced: window for the min RTT filter in sec (10)");
+
+static unsigned int bench_acks;
+module_param(bench_acks, uint, 0444);
+MODULE_PARM_DESC(bench_acks, "at load time, time this many ACKs through "
+                 "each cong_avoid and stock Reno's, and log ns/ACK (0)");
+
+/* Slow start exit, as in CUBIC's HyStart
+ *
+ * Once cwnd reaches hystart_low_window, each round trip of slow start
+ * is watched for either of two signs that the bottleneck queue has
+ * started to fill, in which case ssthresh is set to cwnd so that we
+ * move on to congestion avoidance before overshooting:
+ *
+ *  - ACK train: closely spaced ACKs (no more than hystart_ack_delta_us
+ *    apart) have kept arriving for more than half the minimum RTT,
+ *    i.e. cwnd already covers the path's bandwidth-delay product
+ *  - delay increase: the minimum RTT over the first few ACKs of this
+ *    round exceeds the overall minimum RTT by 1/8, clamped to
+ *    [HYSTART_DELAY_MIN, HYSTART_DELAY_MAX]
+ */
+
+struct hystart {
+    u32 round_start;    /* start of this round trip, usec */
+    u32 last_ack;       /* time of the latest ACK in the train, usec */
+    u32 end_seq;        /* snd_nxt at the start of this round trip */
+    u32 curr_rtt;       /* minimum RTT in this round trip, usec */
+    u32 delay_min;      /* overall minimum RTT, usec */
+    u8 sample_cnt;      /* RTT samples taken in this round trip */
+    u8 found;           /* have we left slow start? */
+};
+
+/* Fixed point for AI gains (see reno_balanced) */
+#define GAIN_SHIFT 10
+#define GAIN_UNIT (1U << GAIN_SHIFT)
+
+/* Every variant's private area begins with this */
+struct reno {
+    struct hystart hs;
+    u32 loss_cwnd;      /* cwnd before the latest reduction */
+    u32 min_rtt_us;     /* min RTT, as exported by get_info */
+    u32 gain;           /* AI gain, GAIN_UNIT = 1.0 */
+};
+
+static void hystart_reset(struct sock *sk)
+{
+    struct tcp_sock *tp = tcp_sk(sk);
+    struct hystart *hs = &((struct reno *)inet_csk_ca(sk))->hs;
+
+    hs->round_start = hs->last_ack = (u32)tp->tcp_mstamp;
+    hs->end_seq = tp->snd_nxt;
+    hs->curr_rtt = ~0U;
+    hs->sample_cnt = 0;
+}
+
+/* Start a new round trip when the previous one has been acked */
+static void hystart_round(struct sock *sk, u32 ack)
+{
+    struct hystart *hs = &((struct reno *)inet_csk_ca(sk))->hs;
+
+    if (hystart && tcp_in_slow_start(tcp_sk(sk)) && after(ack, hs->end_seq))
+        hystart_reset(sk);
+}
+
+static void hystart_update(struct sock *sk, u32 delay)
+{
+    struct tcp_sock *tp = tcp_sk(sk);
+    struct hystart *hs = &((struct reno *)inet_csk_ca(sk))->hs;
+    u32 now = (u32)tp->tcp_mstamp;
+
+    if (hystart & HYSTART_ACK_TRAIN &&
+        (s32)(now - hs->last_ack) <= (s32)hystart_ack_delta_us) {
+        hs->last_ack = now;
+        if ((s32)(now - hs->round_start) > (s32)(hs->delay_min >> 1))
+            hs->found = 1;
+    }
+    if (hystart & HYSTART_DELAY) {
+        if (hs->sample_cnt < HYSTART_MIN_SAMPLES) {
+            hs->curr_rtt = min(hs->curr_rtt, delay);
+            hs->sample_cnt++;
+        }
+        else if (hs->curr_rtt > hs->delay_min +
+                 clamp(hs->delay_min >> 3, HYSTART_DELAY_MIN,
+                       HYSTART_DELAY_MAX))
+            hs->found = 1;
+    }
+    if (hs->found)
+        tp->snd_ssthresh = tcp_snd_cwnd(tp);
+}
+
+static void reno_pkts_acked(struct sock *sk, const struct ack_sample *sample)
+{
+    struct tcp_sock *tp = tcp_sk(sk);
+    struct hystart *hs = &((struct reno *)inet_csk_ca(sk))->hs;
+    u32 delay;
+
+    if (sample->rtt_us < 0)
+        return;
+    delay = max(sample->rtt_us, 1);
+    if (!hs->delay_min || delay < hs->delay_min)
+        hs->delay_min = delay;
+    ((struct reno *)inet_csk_ca(sk))->min_rtt_us = hs->delay_min;
+    if (hystart && !hs->found && tcp_in_slow_start(tp) &&
+        tcp_snd_cwnd(tp) >= hystart_low_window)
+        hystart_update(sk, delay);
+}
+
+/* Shared by all variants */
+
+static void reno_init(struct sock *sk)
+{
+    struct reno *ca = inet_csk_ca(sk);
+    struct hystart *hs = &ca->hs;
+
+    tcp_sk(sk)->snd_ssthresh = TCP_INFINITE_SSTHRESH;
+    tcp_snd_cwnd_set(tcp_sk(sk), 1); // Start with a congestion window of 1
+    ca->loss_cwnd = 0;
+    ca->min_rtt_us = 0;
+    ca->gain = GAIN_UNIT;
+    hs->delay_min = 0;
+    hs->found = 0;
+    hystart_reset(sk);
+    if (pacing)
+        /* Have TCP pace for us if sch_fq is not doing it already */
+        cmpxchg(&sk->sk_pacing_status, SK_PACING_NONE, SK_PACING_NEEDED);
+}
+
+/* Report a cwnd change made by one of our hooks */
+static void reno_trace_cwnd(struct sock *sk, u32 prior, u8 reason)
+{
+    struct reno *ca = inet_csk_ca(sk);
+    u32 cwnd = tcp_snd_cwnd(tcp_sk(sk));
+
+    if (cwnd != prior)
+        trace_reno_cwnd(sk, prior, cwnd, ca->min_rtt_us, ca->gain, reason);
+}
+
+static u32 reno_ssthresh(struct sock *sk)
+{
+    const struct tcp_sock *tp = tcp_sk(sk);
+    struct reno *ca = inet_csk_ca(sk);
+
+    /* Remember cwnd in case the loss turns out to be spurious */
+    ca->loss_cwnd = tcp_snd_cwnd(tp);
+    /* Look for the next slow start exit afresh */
+    ca->hs.found = 0;
+    return max(tcp_snd_cwnd(tp) >> 1U, 2U);
+}
+
+/* Spurious loss (F-RTO, DSACK, Eifel): go back to the prior window */
+static u32 reno_undo_cwnd(struct sock *sk)
+{
+    struct reno *ca = inet_csk_ca(sk);
+    u32 cwnd = tcp_snd_cwnd(tcp_sk(sk)), undo = max(cwnd, ca->loss_cwnd);
+
+    if (undo != cwnd)
+        trace_reno_cwnd(sk, cwnd, undo, ca->min_rtt_us, ca->gain,
+                        RENO_CWND_UNDO);
+    return undo;
+}
+
+static void reno_set_state(struct sock *sk, u8 new_state)
+{
+    struct reno *ca = inet_csk_ca(sk);
+    struct tcp_sock *tp = tcp_sk(sk);
+    u8 state = inet_csk(sk)->icsk_ca_state;
+    u32 prior = tcp_snd_cwnd(tp);
+
+    /* tcp_end_cwnd_reduction() skips sockets with .cong_control, so
+     * end CWR and Recovery at cwnd = ssthresh here, unless undone */
+    if (new_state == TCP_CA_Open && inet_csk(sk)->icsk_ca_ops->cong_control &&
+        tp->snd_ssthresh < TCP_INFINITE_SSTHRESH &&
+        (state == TCP_CA_CWR ||
+         (state == TCP_CA_Recovery && tp->undo_marker))) {
+        tcp_snd_cwnd_set(tp, tp->snd_ssthresh);
+        tp->snd_cwnd_stamp = tcp_jiffies32;
+        reno_trace_cwnd(sk, prior, RENO_CWND_REDUCTION);
+    }
+
+    /* After an RTO we slow start from scratch */
+    if (new_state == TCP_CA_Loss) {
+        ca->hs.found = 0;
+        hystart_reset(sk);
+        trace_reno_cwnd(sk, ca->loss_cwnd, tcp_snd_cwnd(tcp_sk(sk)),
+                        ca->min_rtt_us, ca->gain, RENO_CWND_LOSS);
+    }
+}
+
+static void reno_cwnd_event(struct sock *sk, enum tcp_ca_event event)
+{
+    struct reno *ca = inet_csk_ca(sk);
+
+    switch (event) {
+    case CA_EVENT_CWND_RESTART:
+        /* cwnd was reset after idle (RFC 2861): slow start again */
+        ca->hs.found = 0;
+        hystart_reset(sk);
+        break;
+    case CA_EVENT_TX_START:
+        /* Don't let an ACK train or RTT round span an idle period */
+        hystart_reset(sk);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Export our state for ss -ti and other inet_diag users. We reuse
+ * struct tcpvegas_info, with:
+ *
+ *  tcpv_enabled: 1, | 2 if HyStart has ended slow start, | 4 if pacing,
+ *                | 8 if driven by rate samples
+ *  tcpv_rttcnt:  AI gain, 1024 = 1.0 (reno_balanced; 1024 otherwise)
+ *  tcpv_rtt:     smoothed RTT, usec
+ *  tcpv_minrtt:  minimum RTT, usec (windowed for reno_balanced)
+ *
+ * cwnd and ssthresh are already in struct tcp_info.
+ */
+static size_t reno_get_info(struct sock *sk, u32 ext, int *attr,
+                            union tcp_cc_info *info)
+{
+    const struct reno *ca = inet_csk_ca(sk);
+
+    if (ext & (1 << (INET_DIAG_VEGASINFO - 1))) {
+        memset(&info->vegas, 0, sizeof(info->vegas));
+        info->vegas.tcpv_enabled = 1 | (ca->hs.found ? 2 : 0) |
+                                   (pacing ? 4 : 0) | (rate_sample ? 8 : 0);
+        info->vegas.tcpv_rttcnt = ca->gain;
+        info->vegas.tcpv_rtt = tcp_sk(sk)->srtt_us >> 3;
+        info->vegas.tcpv_minrtt = ca->min_rtt_us;
+        *attr = INET_DIAG_VEGASINFO;
+        return sizeof(struct tcpvegas_info);
+    }
+    return 0;
+}
+
+/* reno_custom: classic Reno */
+
+static void reno_classic_cong_avoid(struct sock *sk, u32 ack, u32 acked)
+{
+    struct tcp_sock *tp = tcp_sk(sk);
+    u32 prior = tcp_snd_cwnd(tp);
+    u8 reason = RENO_CWND_SLOW_START;
+
+    if (!tcp_is_cwnd_limited(sk))
+        return;
+
+    hystart_round(sk, ack);
+
+    if (tcp_snd_cwnd(tp) <= tp->snd_ssthresh)
+        tcp_snd_cwnd_set(tp, tcp_snd_cwnd(tp) + 1);
+    else {
+        /* In "congestion avoidance", cwnd is increased by 1 full packet
+         * per round-trip time (RTT), which is approximated here by the
+         * number of ACKed packets divided by the current window. */
+        tcp_cong_avoid_ai(tp, tcp_snd_cwnd(tp), acked);
+        reason = RENO_CWND_AVOIDANCE;
+    }
+
+    /* Ensure that cwnd does not exceed the maximum allowed value */
+    tcp_snd_cwnd_set(tp, min(tcp_snd_cwnd(tp), tp->snd_cwnd_clamp));
+    reno_trace_cwnd(sk, prior, reason);
+}
+
+/* reno_abc: Appropriate Byte Counting
+ *
+ * Newly acknowledged bytes are taken from the difference in
+ * tp->bytes_acked since the previous ACK and added to a per-socket
+ * accumulator. In slow start, cwnd grows by one segment for every mss
+ * bytes in the accumulator, up to ssthresh; in congestion avoidance,
+ * by one segment for every cwnd * mss bytes. The accumulator is reset
+ * whenever cwnd is reduced.
+ *
+ * The stack does not call cong_avoid during CWR and Recovery, so the
+ * bytes_acked checkpoint is also moved up on every change of state:
+ * bytes acked while cwnd was being reduced do not count as growth
+ * when the first ACK after recovery comes.
+ *
+ * L caps slow start growth per ACK. A stretch ACK, e.g. after GRO/LRO
+ * on the receiver, covers acked segments and so stands in for acked/2
+ * ordinary delayed ACKs: the cap scales with it, so that stretch ACKs
+ * do not slow growth down below what Reno would achieve.
+ *
+ * There is no division on the per-ACK path: bytes are turned into
+ * segments using a reciprocal of mss, which is only recomputed when
+ * mss changes, and congestion avoidance subtracts whole windows.
+ */
+
+struct abc {
+    struct reno reno;
+    u64 prior_bytes_acked;  /* tp->bytes_acked at the previous ACK or
+                             * change of state */
+    u32 bytes_acked;        /* bytes not yet turned into cwnd growth */
+    u32 mss;                /* mss that mss_recip is for */
+    struct reciprocal_value mss_recip;
+};
+
+static void reno_abc_init(struct sock *sk)
+{
+    struct abc *ca = inet_csk_ca(sk);
+
+    reno_init(sk);
+    ca->prior_bytes_acked = tcp_sk(sk)->bytes_acked;
+    ca->bytes_acked = 0;
+    ca->mss = 0;
+}
+
+static u32 reno_abc_ssthresh(struct sock *sk)
+{
+    struct abc *ca = inet_csk_ca(sk);
+
+    ca->prior_bytes_acked = tcp_sk(sk)->bytes_acked;
+    ca->bytes_acked = 0;
+    return reno_ssthresh(sk);
+}
+
+static void reno_abc_set_state(struct sock *sk, u8 new_state)
+{
+    struct abc *ca = inet_csk_ca(sk);
+
+    ca->prior_bytes_acked = tcp_sk(sk)->bytes_acked;
+    if (new_state == TCP_CA_Loss)
+        ca->bytes_acked = 0;
+    reno_set_state(sk, new_state);
+}
+
+static void reno_abc_cwnd_event(struct sock *sk, enum tcp_ca_event event)
+{
+    struct abc *ca = inet_csk_ca(sk);
+
+    if (event == CA_EVENT_CWND_RESTART)
+        ca->bytes_acked = 0;
+    reno_cwnd_event(sk, event);
+}
+
+static void reno_abc_cong_avoid(struct sock *sk, u32 ack, u32 acked)
+{
+    struct tcp_sock *tp = tcp_sk(sk);
+    struct abc *ca = inet_csk_ca(sk);
+    u32 mss = tp->mss_cache;
+    u32 bytes = tp->bytes_acked - ca->prior_bytes_acked;
+    u32 inc, room, window, cwnd = tcp_snd_cwnd(tp), prior = cwnd;
+    u8 reason = RENO_CWND_AVOIDANCE;
+
+    ca->prior_bytes_acked = tp->bytes_acked;
+    if (!tcp_is_cwnd_limited(sk))
+        return;
+
+    hystart_round(sk, ack);
+
+    if (unlikely(mss != ca->mss)) {
+        mss = ca->mss = max(mss, 1U);
+        ca->mss_recip = reciprocal_value(mss);
+    }
+
+    if (tcp_in_slow_start(tp)) {
+        reason = RENO_CWND_SLOW_START;
+        if (abc_l)
+            bytes = min(bytes, abc_l * mss * max(acked >> 1, 1U));
+        ca->bytes_acked += bytes;
+        inc = reciprocal_divide(ca->bytes_acked, ca->mss_recip);
+        room = tp->snd_ssthresh - cwnd;
+        if (inc <= room) {
+            cwnd += inc;
+            ca->bytes_acked -= inc * mss;
+            goto clamp;
+        }
+        /* Leaving slow start: the rest counts towards avoidance */
+        cwnd += room;
+        ca->bytes_acked -= room * mss;
+    }
+    else
+        ca->bytes_acked += bytes;
+
+    /* Usually at most once per RTT, but stretch ACKs may cover more */
+    for (window = cwnd * mss; ca->bytes_acked >= window; window += mss) {
+        ca->bytes_acked -= window;
+        cwnd++;
+    }
+clamp:
+    tcp_snd_cwnd_set(tp, min(cwnd, tp->snd_cwnd_clamp));
+    reno_trace_cwnd(sk, prior, reason);
+}
+
+/* reno_balanced: RTT-fair congestion avoidance
+ *
+ * Reno's throughput goes as 1/RTT^2 (cwnd/RTT, and cwnd grows once per
+ * RTT), so to even it out the additive increase per RTT is scaled by
+ * gain = (min_rtt / base_rtt_us)^2, as in TCP Hybla. min_rtt is a
+ * windowed minimum, so that it follows path changes but not queueing
+ * delay: as in BBR, a sample replaces it if lower, or once it is older
+ * than min_rtt_win_sec (lib/win_minmax.c only exports the running max,
+ * for BBR). gain is clamped to [1/fast_penalty, slow_boost], is fixed
+ * point, GAIN_UNIT = 1.0, and is recomputed when min_rtt changes and
+ * otherwise once per min_rtt, so that changes to base_rtt_us,
+ * fast_penalty and slow_boost also reach existing flows.
+ *
+ * Rather than dividing cwnd by gain on every ACK, each ACKed segment
+ * earns gain units of credit, and cwnd grows by one segment for every
+ * cwnd << GAIN_SHIFT units earned.
+ */
+
+struct balanced {
+    struct reno reno;
+    u32 min_rtt;            /* windowed min RTT, usec, 0 for none yet */
+    u32 min_rtt_stamp;      /* when min_rtt was sampled, usec */
+    u32 gain_stamp;         /* when gain was computed, usec */
+    u32 credit;             /* AI credit, GAIN_UNIT per segment */
+};
+
+static void reno_balanced_init(struct sock *sk)
+{
+    struct balanced *ca = inet_csk_ca(sk);
+
+    reno_init(sk);
+    ca->min_rtt = 0;
+    ca->min_rtt_stamp = ca->gain_stamp = (u32)tcp_sk(sk)->tcp_mstamp;
+    ca->credit = 0;
+}
+
+static u32 reno_balanced_ssthresh(struct sock *sk)
+{
+    struct balanced *ca = inet_csk_ca(sk);
+
+    ca->credit = 0;
+    return reno_ssthresh(sk);
+}
+
+static u32 reno_balanced_gain(u32 min_rtt_us)
+{
+    u32 lo = GAIN_UNIT / max(fast_penalty, 1U);
+    u32 hi = GAIN_UNIT * max(slow_boost, 1U);
+    u64 rho = div_u64((u64)min_rtt_us << GAIN_SHIFT, max(base_rtt_us, 1U));
+
+    /* Limiting rho to hi first keeps rho^2 from overflowing */
+    rho = min_t(u64, rho, hi);
+    return clamp((u32)((rho * rho) >> GAIN_SHIFT), lo, hi);
+}
+
+static void reno_balanced_pkts_acked(struct sock *sk,
+                                     const struct ack_sample *sample)
+{
+    struct balanced *ca = inet_csk_ca(sk);
+    u32 now = (u32)tcp_sk(sk)->tcp_mstamp, rtt;
+    bool changed = false;
+
+    reno_pkts_acked(sk, sample);
+    if (sample->rtt_us < 0)
+        return;
+    rtt = max(sample->rtt_us, 1);
+    if (!ca->min_rtt || rtt < ca->min_rtt ||
+        now - ca->min_rtt_stamp > min_rtt_win_sec * USEC_PER_SEC) {
+        changed = rtt != ca->min_rtt;
+        ca->min_rtt = rtt;
+        ca->min_rtt_stamp = now;
+    }
+    ca->reno.min_rtt_us = ca->min_rtt;
+    if (changed || now - ca->gain_stamp >= ca->min_rtt) {
+        ca->gain_stamp = now;
+        ca->reno.gain = reno_balanced_gain(ca->min_rtt);
+    }
+}
+
+static void reno_balanced_cong_avoid(struct sock *sk, u32 ack, u32 acked)
+{
+    struct tcp_sock *tp = tcp_sk(sk);
+    struct balanced *ca = inet_csk_ca(sk);
+    u32 window, cwnd, prior = tcp_snd_cwnd(tp);
+
+    if (!tcp_is_cwnd_limited(sk))
+        return;
+
+    hystart_round(sk, ack);
+
+    if (tcp_snd_cwnd(tp) <= tp->snd_ssthresh) {
+        acked = tcp_slow_start(tp, acked);
+        if (!acked) {
+            reno_trace_cwnd(sk, prior, RENO_CWND_SLOW_START);
+            return;
+        }
+    }
+
+    /* Grow by gain segments per cwnd acked */
+    ca->credit += acked * ca->reno.gain;
+    cwnd = tcp_snd_cwnd(tp);
+    for (window = cwnd << GAIN_SHIFT; ca->credit >= window;
+         window += GAIN_UNIT) {
+        ca->credit -= window;
+        cwnd++;
+    }
+
+    tcp_snd_cwnd_set(tp, min(cwnd, tp->snd_cwnd_clamp));
+    reno_trace_cwnd(sk, prior, RENO_CWND_AVOIDANCE);
+}
+
+/* These structures contain the hooks to our congestion control variants */
+static struct tcp_congestion_ops reno_variants[] __read_mostly = {
+    {
+        .init           = reno_init,
+        .ssthresh       = reno_ssthresh,
+        .cong_avoid     = reno_classic_cong_avoid,
+        .undo_cwnd      = reno_undo_cwnd,
+        .set_state      = reno_set_state,
+        .cwnd_event     = reno_cwnd_event,
+        .pkts_acked     = reno_pkts_acked,
+        .get_info       = reno_get_info,
+        .owner          = THIS_MODULE,
+        .name           = "reno_custom",
+    },
+    {
+        .init           = reno_abc_init,
+        .ssthresh       = reno_abc_ssthresh,
+        .cong_avoid     = reno_abc_cong_avoid,
+        .undo_cwnd      = reno_undo_cwnd,
+        .set_state      = reno_abc_set_state,
+        .cwnd_event     = reno_abc_cwnd_event,
+        .pkts_acked     = reno_pkts_acked,
+        .get_info       = reno_get_info,
+        .owner          = THIS_MODULE,
+        .name           = "reno_abc",
+    },
+    {
+        .init           = reno_balanced_init,
+        .ssthresh       = reno_balanced_ssthresh,
+        .cong_avoid     = reno_balanced_cong_avoid,
+        .undo_cwnd      = reno_undo_cwnd,
+        .set_state      = reno_set_state,
+        .cwnd_event     = reno_cwnd_event,
+        .pkts_acked     = reno_balanced_pkts_acked,
+        .get_info       = reno_get_info,
+        .owner          = THIS_MODULE,
+        .name           = "reno_balanced",
+    },
+};
+
+/* Pacing and rate samples
+ *
+ * With pacing=1, every variant gets a .cong_control hook, which runs
+ * the variant's own cong_avoid and then sets sk_pacing_rate to
+ *
+ *   gain * max(cwnd, packets_out) * mss / srtt
+ *
+ * with pacing_ss_gain in the first half of slow start and
+ * pacing_ca_gain after that. TSO autosizing follows sk_pacing_rate, so
+ * this also shrinks the bursts handed to the qdisc to about 1 ms worth
+ * of data. As .cong_control replaces tcp_cong_control(), whose PRR code
+ * is not available to modules, cwnd reductions are done here too, with
+ * Proportional Rate Reduction (RFC 6937): while in flight is above
+ * ssthresh, one packet is sent per prior_cwnd / ssthresh delivered, so
+ * that in flight reaches ssthresh by the end of recovery; below it, the
+ * slow start reduction bound lets it grow back by at most one packet
+ * more than was delivered. Recovery ends at cwnd = ssthresh, see
+ * reno_set_state().
+ *
+ * This approximates tcp_cong_control() with what a module can see:
+ * the ACK flags of tcp_input.c are private to it (and not passed at all
+ * before 6.10), so cwnd grows on any ACK that delivered something, where
+ * tcp_may_raise_cwnd() wants in-order delivery unless reordering is
+ * high, and PRR-SSRB's extra packet goes with every ACK that reports no
+ * new losses rather than only with those advancing snd_una.
+ *
+ * With rate_sample=1, the variants are driven from .cong_control too,
+ * paced or not, and take everything they need from the ACK's delivery
+ * rate sample: the RTT sample that .pkts_acked would have been given,
+ * and the segments delivered, SACKed ones included. Their .pkts_acked
+ * hooks are unhooked and called from here instead, which saves an
+ * indirect call per ACK, and cwnd does not grow on samples the rate
+ * estimator has marked application limited. sk_pacing_rate is updated
+ * as with pacing=1 even then, as tcp_update_pacing_rate() only runs
+ * from the tcp_cong_control() this replaces, and TSO autosizing and fq
+ * would otherwise go by the rate set at connect time.
+ */
+
+/* .pkts_acked of each of reno_variants, with rate_sample=1 */
+static void (*reno_rtt_hooks[ARRAY_SIZE(reno_variants)])(
+    struct sock *sk, const struct ack_sample *sample);
+
+static void reno_pacing_rate(struct sock *sk)
+{
+    struct tcp_sock *tp = tcp_sk(sk);
+    u64 rate = (u64)tp->mss_cache * ((USEC_PER_SEC / 100) << 3);
+
+    if (tcp_snd_cwnd(tp) < tp->snd_ssthresh / 2)
+        rate *= pacing_ss_gain;
+    else
+        rate *= pacing_ca_gain;
+    rate *= max(tcp_snd_cwnd(tp), tp->packets_out);
+    /* srtt_us is in usec << 3, matching the << 3 above */
+    if (likely(tp->srtt_us))
+        rate = div64_u64(rate, tp->srtt_us);
+    WRITE_ONCE(sk->sk_pacing_rate, min_t(u64, rate, sk->sk_max_pacing_rate));
+}
+
+/* tcp_cwnd_reduction(), which is not exported. The stack initializes
+ * prior_cwnd and the PRR counters on entering CWR or Recovery and counts
+ * prr_out as it sends; prr_delivered is ours to count.
+ */
+static void reno_prr(struct sock *sk, const struct rate_sample *rs)
+{
+    struct tcp_sock *tp = tcp_sk(sk);
+    int delta = tp->snd_ssthresh - tcp_packets_in_flight(tp);
+    int delivered = rs->acked_sacked;
+    int sndcnt;
+
+    if (delivered <= 0 || WARN_ON_ONCE(!tp->prior_cwnd))
+        return;
+
+    tp->prr_delivered += delivered;
+    if (delta < 0) {
+        u64 dividend = (u64)tp->snd_ssthresh * tp->prr_delivered +
+                       tp->prior_cwnd - 1;
+
+        sndcnt = div_u64(dividend, tp->prior_cwnd) - tp->prr_out;
+    } else {
+        /* PRR-SSRB */
+        sndcnt = max_t(int, tp->prr_delivered - tp->prr_out, delivered);
+        if (!rs->losses)
+            sndcnt++;
+        sndcnt = min(delta, sndcnt);
+    }
+    /* Force a fast retransmit upon entering fast recovery */
+    sndcnt = max(sndcnt, tp->prr_out ? 0 : 1);
+    tcp_snd_cwnd_set(tp, tcp_packets_in_flight(tp) + sndcnt);
+}
+
+static void reno_control(struct sock *sk, u32 ack,
+                         const struct rate_sample *rs)
+{
+    const struct tcp_congestion_ops *ops = inet_csk(sk)->icsk_ca_ops;
+    struct tcp_sock *tp = tcp_sk(sk);
+    u32 prior = tcp_snd_cwnd(tp), acked = rs->acked_sacked;
+
+    if (rate_sample) {
+        struct ack_sample sample = {
+            .pkts_acked = acked,
+            .rtt_us     = rs->rtt_us,
+            .in_flight  = rs->prior_in_flight,
+        };
+
+        reno_rtt_hooks[ops - reno_variants](sk, &sample);
+    }
+
+    if (tcp_in_cwnd_reduction(sk)) {
+        reno_prr(sk, rs);
+        reno_trace_cwnd(sk, prior, RENO_CWND_REDUCTION);
+    }
+    /* Like tcp_cong_control(), only grow when something was delivered */
+    else if (acked && !(rate_sample && rs->is_app_limited)) {
+        ops->cong_avoid(sk, ack, acked);
+        tp->snd_cwnd_stamp = tcp_jiffies32;
+    }
+
+    reno_pacing_rate(sk);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+static void reno_cong_control(struct sock *sk, u32 ack, int flag,
+                              const struct rate_sample *rs)
+{
+    reno_control(sk, ack, rs);
+}
+#else
+static void reno_cong_control(struct sock *sk, const struct rate_sample *rs)
+{
+    reno_control(sk, tcp_sk(sk)->snd_una, rs);
+}
+#endif
+
+/* Microbenchmark of the per-ACK path
+ *
+ * Feeds bench_acks one-segment ACKs through a variant's cong_avoid on
+ * a fake socket in congestion avoidance, which is where nearly all
+ * ACKs of a long flow go, and logs the average cost, e.g.
+ *
+ *   insmod reno_custom.ko bench_acks=10000000 && dmesg | tail -4
+ *
+ * Only cong_avoid runs, so this leaves out the cost of the rest of the
+ * ACK path, which is the same for every variant. cwnd goes back to 10
+ * every RENO_BENCH_RESTART ACKs.
+ */
+#define RENO_BENCH_RESTART  (1U << 20)
+
+static void __init reno_bench(struct sock *sk, const char *name,
+                              void (*init)(struct sock *sk),
+                              void (*cong_avoid)(struct sock *sk, u32 ack,
+                                                 u32 acked))
+{
+    struct tcp_sock *tp = tcp_sk(sk);
+    u64 start, ns;
+    u32 i;
+
+    memset(tp, 0, sizeof(*tp));
+    /* init first, as our variants' would put us back in slow start */
+    if (init)
+        init(sk);
+    tcp_snd_cwnd_set(tp, 10);
+    tp->snd_ssthresh = 2;
+    tp->snd_cwnd_clamp = ~0U;
+    tp->mss_cache = 1448;
+    tp->is_cwnd_limited = 1;
+
+    start = ktime_get_ns();
+    for (i = 0; i < bench_acks; i++) {
+        /* Start over now and then, so that cwnd * mss stays in range */
+        if (!(i % RENO_BENCH_RESTART))
+            tcp_snd_cwnd_set(tp, 10);
+        tp->bytes_acked += tp->mss_cache;
+        cong_avoid(sk, i, 1);
+    }
+    ns = ktime_get_ns() - start;
+
+    ns = div_u64(ns * 100, bench_acks);
+    pr_info("reno_custom: %-13s %llu.%02llu ns/ACK, cwnd 10 -> %u in %u ACKs\n",
+            name, div_u64(ns, 100), ns % 100, tcp_snd_cwnd(tp),
+            (bench_acks - 1) % RENO_BENCH_RESTART + 1);
+}
+
+/* Initialization function of this module */
+static int __init reno_module_init(void)
+{
+    struct sock *sk;
+    int i, err;
+
+    BUILD_BUG_ON(sizeof(struct reno) > ICSK_CA_PRIV_SIZE);
+    BUILD_BUG_ON(sizeof(struct abc) > ICSK_CA_PRIV_SIZE);
+    BUILD_BUG_ON(sizeof(struct balanced) > ICSK_CA_PRIV_SIZE);
+    sk = bench_acks ? kzalloc(sizeof(struct tcp_sock), GFP_KERNEL) : NULL;
+    if (sk) {
+        reno_bench(sk, "reno", NULL, tcp_reno_cong_avoid);
+        for (i = 0; i < ARRAY_SIZE(reno_variants); i++)
+            reno_bench(sk, reno_variants[i].name, reno_variants[i].init,
+                       reno_variants[i].cong_avoid);
+        kfree(sk);
+    }
+    for (i = 0; i < ARRAY_SIZE(reno_variants); i++) {
+        if (pacing || rate_sample)
+            reno_variants[i].cong_control = reno_cong_control;
+        if (rate_sample) {
+            reno_rtt_hooks[i] = reno_variants[i].pkts_acked;
+            reno_variants[i].pkts_acked = NULL;
+        }
+        err = tcp_register_congestion_control(&reno_variants[i]);
+        if (err) {
+            while (--i >= 0)
+                tcp_unregister_congestion_control(&reno_variants[i]);
+            return err;
+        }
+    }
+    return 0;
+}
+
+/* Cleanup function of this module */
+static void __exit reno_module_exit(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(reno_variants); i++)
+        tcp_unregister_congestion_control(&reno_variants[i]);
+}
+
+module_init(reno_module_init);
+module_exit(reno_module_exit);
+
+MODULE_AUTHOR("nethw");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("TCP Reno variants: classic, ABC and RTT-fair");
+MODULE_ALIAS("tcp_reno_custom");
+MODULE_ALIAS("tcp_reno_abc");
+MODULE_ALIAS("tcp_reno_balanced");
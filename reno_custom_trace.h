@@ -0,0 +1,83 @@
+/* Tracepoints for reno_custom.ko
+ *
+ * reno_custom:reno_cwnd fires whenever one of our variants changes
+ * cwnd, e.g. for an eBPF collector or
+ *
+ *   echo 1 > /sys/kernel/tracing/events/reno_custom/reno_cwnd/enable
+ *
+ * Disabled tracepoints are a static branch, so this costs nothing
+ * unless someone is listening.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM reno_custom
+
+#if !defined(_RENO_CUSTOM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RENO_CUSTOM_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <net/tcp.h>
+
+/* Why cwnd changed */
+#define RENO_CWND_SLOW_START    0
+#define RENO_CWND_AVOIDANCE     1
+#define RENO_CWND_REDUCTION     2
+#define RENO_CWND_UNDO          3
+#define RENO_CWND_LOSS          4
+
+TRACE_EVENT(reno_cwnd,
+
+    TP_PROTO(const struct sock *sk, u32 prior_cwnd, u32 cwnd, u32 min_rtt,
+             u32 gain, u8 reason),
+
+    TP_ARGS(sk, prior_cwnd, cwnd, min_rtt, gain, reason),
+
+    TP_STRUCT__entry(
+        __field(const void *, skaddr)
+        __field(u16, sport)
+        __field(u16, dport)
+        __field(u32, prior_cwnd)
+        __field(u32, cwnd)
+        __field(u32, ssthresh)
+        __field(u32, srtt)
+        __field(u32, min_rtt)
+        __field(u32, gain)
+        __field(u8, reason)
+    ),
+
+    TP_fast_assign(
+        const struct inet_sock *inet = inet_sk(sk);
+        const struct tcp_sock *tp = tcp_sk(sk);
+
+        __entry->skaddr = sk;
+        __entry->sport = ntohs(inet->inet_sport);
+        __entry->dport = ntohs(inet->inet_dport);
+        __entry->prior_cwnd = prior_cwnd;
+        __entry->cwnd = cwnd;
+        __entry->ssthresh = tp->snd_ssthresh;
+        __entry->srtt = tp->srtt_us >> 3;
+        __entry->min_rtt = min_rtt;
+        __entry->gain = gain;
+        __entry->reason = reason;
+    ),
+
+    TP_printk("skaddr=%p sport=%hu dport=%hu cwnd=%u->%u ssthresh=%u "
+              "srtt=%u min_rtt=%u gain=%u reason=%s",
+              __entry->skaddr, __entry->sport, __entry->dport,
+              __entry->prior_cwnd, __entry->cwnd, __entry->ssthresh,
+              __entry->srtt, __entry->min_rtt, __entry->gain,
+              __print_symbolic(__entry->reason,
+                               { RENO_CWND_SLOW_START, "slow_start" },
+                               { RENO_CWND_AVOIDANCE, "avoidance" },
+                               { RENO_CWND_REDUCTION, "reduction" },
+                               { RENO_CWND_UNDO, "undo" },
+                               { RENO_CWND_LOSS, "loss" }))
+);
+
+#endif /* _RENO_CUSTOM_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE reno_custom_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,63 @@
+#!/usr/bin/env python
+
+"""
+Benchmark mnexec -c launch cost with close_range() and with the
+/proc/self/fd (getdents64) fallback.
+
+usage: closefds-bench.py [launches] [open fds]
+
+Builds both variants of mnexec from the source tree, raises our fd
+limit as far as possible, opens a number of extra descriptors, and
+reports the mean time per 'mnexec -c true' launch for each variant.
+"""
+
+import os
+import shutil
+import sys
+import tempfile
+from resource import getrlimit, setrlimit, RLIMIT_NOFILE
+from subprocess import call, check_call
+from time import time
+
+def build( srcdir, outdir ):
+    "Build normal and fallback variants of mnexec"
+    cc = os.environ.get( 'CC', 'cc' )
+    src = os.path.join( srcdir, 'mnexec.c' )
+    variants = { 'close_range': [], 'getdents64': [ '-DNO_CLOSE_RANGE' ] }
+    paths = {}
+    for name, flags in variants.items():
+        paths[ name ] = os.path.join( outdir, 'mnexec-' + name )
+        check_call( [ cc, '-O2' ] + flags + [ '-o', paths[ name ], src ] )
+    return paths
+
+def bench( mnexec, launches ):
+    "Return mean seconds per launch, passing our fds through"
+    start = time()
+    for _ in range( launches ):
+        call( [ mnexec, '-c', 'true' ], close_fds=False )
+    return ( time() - start ) / launches
+
+def main():
+    "Build, open fds and run benchmarks"
+    launches = int( sys.argv[ 1 ] ) if len( sys.argv ) > 1 else 1000
+    openfds = int( sys.argv[ 2 ] ) if len( sys.argv ) > 2 else 64
+    _soft, hard = getrlimit( RLIMIT_NOFILE )
+    setrlimit( RLIMIT_NOFILE, ( hard, hard ) )
+    srcdir = os.path.join( os.path.dirname( os.path.abspath( __file__ ) ),
+                           '..' )
+    tmpdir = tempfile.mkdtemp()
+    try:
+        paths = build( srcdir, tmpdir )
+        fds = [ os.open( '/dev/null', os.O_RDONLY ) for _ in range( openfds ) ]
+        for fd in fds:
+            os.set_inheritable( fd, True )
+        print( '*** %d launches, %d extra fds, fd limit %d' % (
+            launches, openfds, hard ) )
+        for name in sorted( paths ):
+            usecs = bench( paths[ name ], launches ) * 1e6
+            print( '%s: %.1f us/launch' % ( name, usecs ) )
+    finally:
+        shutil.rmtree( tmpdir )
+
+if __name__ == '__main__':
+    main()
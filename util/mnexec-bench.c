@@ -0,0 +1,324 @@
+/* mnexec-bench: startup-time benchmark for mnexec
+ *
+ * For each node count given on the command line (default: 1 100 1000),
+ * we bring up that many nodes with
+ *
+ *   mnexec -t -c [-g group] -n mnexec-bench -X
+ *
+ * keeping every namespace alive, then attach to each of them with
+ *
+ *   mnexec -t -c -a pid mnexec-bench -x
+ *
+ * and tear them all down. mnexec -t reports how long each setup phase
+ * took (fd close, unshare, remount, sysfs mount, setns, cgroup), and
+ * the exec'd copy of mnexec-bench reports how long the exec itself
+ * took, so we can print percentiles for every phase at each scale.
+ *
+ * Must be run as root, like mnexec. With -g, nodes are added to a
+ * benchmark cgroup, which we create (and remove) ourselves; -g has to
+ * come before -n, since the new sysfs mount hides /sys/fs/cgroup.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAXPHASES 16
+#define GROUP "mnbench"
+#define CGROOT "/sys/fs/cgroup"
+
+struct phase {
+    const char *name;
+    long long *ns;
+    int count;
+};
+
+static struct phase phases[MAXPHASES];
+static int nphases;
+static int maxsamples;
+static char self[PATH_MAX];
+
+void usage(char *name)
+{
+    printf("Startup-time benchmark for mnexec\n\n"
+           "Usage: %s [-m mnexec] [-g] [-j] [count...]\n\n"
+           "Options:\n"
+           "  -m mnexec: mnexec binary to benchmark (default: ./mnexec)\n"
+           "  -g: also time cgroup attach, using a benchmark cgroup\n"
+           "  -j: print results as JSON lines\n"
+           "  count: number of nodes per run (default: 1 100 1000)\n",
+           name);
+}
+
+long long monotonic(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Record a sample for a phase, e.g. "create.unshare" */
+void record(const char *step, const char *name, int len, long long ns)
+{
+    char buf[64];
+    int i;
+    snprintf(buf, sizeof(buf), "%s.%.*s", step, len, name);
+    for (i = 0; i < nphases; i++)
+        if (!strcmp(phases[i].name, buf))
+            break;
+    if (i == nphases) {
+        if (nphases == MAXPHASES)
+            return;
+        phases[i].name = strdup(buf);
+        phases[i].ns = calloc(maxsamples, sizeof(long long));
+        phases[i].count = 0;
+        nphases++;
+    }
+    if (phases[i].count < maxsamples)
+        phases[i].ns[phases[i].count++] = ns;
+}
+
+/* Parse mnexec -t output followed by our own exec stamp */
+int parse(const char *step, char *out)
+{
+    char *line = strstr(out, "mnexec-time"), *stamp = strstr(out, "stamp=");
+    char *s, *eq;
+    long long exec = 0;
+    if (!line || !stamp)
+        return -1;
+    for (s = line + 11; *s == ' '; ) {
+        eq = strchr(++s, '=');
+        if (!eq)
+            break;
+        if (!strncmp(s, "exec=", 5))
+            exec = atoll(eq + 1);
+        else
+            record(step, s, eq - s, atoll(eq + 1));
+        s = eq + strcspn(eq, " \n");
+    }
+    record(step, "exec", 4, atoll(stamp + 6) - exec);
+    return 0;
+}
+
+/* Run mnexec with args, then self -X or -x; returns child pid or -1 */
+pid_t run(const char *step, char **args, long long *total)
+{
+    char out[1024], *stamp;
+    int fds[2], len = 0, n;
+    long long start = monotonic();
+    pid_t pid;
+
+    if (pipe(fds) != 0)
+        return -1;
+    pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], 1);
+        dup2(fds[1], 2);
+        close(fds[0]);
+        close(fds[1]);
+        execvp(args[0], args);
+        perror(args[0]);
+        _exit(1);
+    }
+    close(fds[1]);
+    /* Read until the exec'd copy of us has reported */
+    while (pid > 0 && len < (int)sizeof(out) - 1 &&
+           (n = read(fds[0], out + len, sizeof(out) - 1 - len)) > 0) {
+        len += n;
+        out[len] = 0;
+        stamp = strstr(out, "stamp=");
+        if (stamp && strchr(stamp, '\n'))
+            break;
+    }
+    out[len] = 0;
+    close(fds[0]);
+    *total = monotonic() - start;
+    if (pid < 0 || parse(step, out) != 0) {
+        fprintf(stderr, "mnexec-bench: %s failed: %s", step, out);
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+        return -1;
+    }
+    record(step, "total", 5, *total);
+    return pid;
+}
+
+int compare(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+long long percentile(struct phase *p, int pct)
+{
+    return p->ns[(p->count - 1) * pct / 100];
+}
+
+void report(int count, int json)
+{
+    struct phase *p;
+    if (!json)
+        printf("\n%d node%s (usec)\n%-18s %9s %9s %9s %9s\n", count,
+               count == 1 ? "" : "s", "phase", "p50", "p90", "p99", "max");
+    for (p = phases; p < phases + nphases; p++) {
+        if (!p->count)
+            continue;
+        qsort(p->ns, p->count, sizeof(long long), compare);
+        if (json)
+            printf("{\"nodes\":%d,\"phase\":\"%s\",\"samples\":%d,"
+                   "\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"max\":%lld}\n",
+                   count, p->name, p->count, percentile(p, 50),
+                   percentile(p, 90), percentile(p, 99),
+                   p->ns[p->count - 1]);
+        else
+            printf("%-18s %9.1f %9.1f %9.1f %9.1f\n", p->name,
+                   percentile(p, 50) / 1e3, percentile(p, 90) / 1e3,
+                   percentile(p, 99) / 1e3, p->ns[p->count - 1] / 1e3);
+    }
+    fflush(stdout);
+    for (p = phases; p < phases + nphases; p++) {
+        free((char *)p->name);
+        free(p->ns);
+    }
+    nphases = 0;
+}
+
+/* Create (or remove) our benchmark cgroup */
+int mkgroup(int create)
+{
+    static const char *v1[] = { "cpu", "cpuacct", NULL };
+    char path[PATH_MAX];
+    const char **c;
+    int ok = 0;
+    if (access(CGROOT "/cgroup.controllers", F_OK) == 0) {
+        /* cgroup v2 */
+        snprintf(path, sizeof(path), CGROOT "/" GROUP);
+        return (create ? mkdir(path, 0755) == 0 || errno == EEXIST
+                       : rmdir(path) == 0) ? 0 : -1;
+    }
+    for (c = v1; *c; c++) {
+        snprintf(path, sizeof(path), CGROOT "/%s/" GROUP, *c);
+        if (create ? mkdir(path, 0755) == 0 || errno == EEXIST
+                   : rmdir(path) == 0)
+            ok = 1;
+    }
+    return ok ? 0 : -1;
+}
+
+int bench(char *mnexec, int count, int cgroups, int json)
+{
+    char pidarg[16];
+    char *create[] = { mnexec, "-t", "-c", "-g", GROUP, "-n",
+                       self, "-X", NULL };
+    char *attach[] = { mnexec, "-t", "-c", "-a", pidarg, self, "-x", NULL };
+    pid_t *pids = calloc(count, sizeof(pid_t)), pid;
+    long long total, start;
+    int i, failed = 0;
+
+    if (!pids)
+        return 1;
+    if (!cgroups) {
+        create[3] = "-n";
+        create[4] = self;
+        create[5] = "-X";
+        create[6] = NULL;
+    }
+    maxsamples = count;
+    start = monotonic();
+    for (i = 0; i < count; i++)
+        if ((pids[i] = run("create", create, &total)) < 0)
+            failed = 1;
+    record("all", "create", 6, monotonic() - start);
+    start = monotonic();
+    for (i = 0; i < count; i++) {
+        if (pids[i] <= 0)
+            continue;
+        snprintf(pidarg, sizeof(pidarg), "%d", pids[i]);
+        pid = run("attach", attach, &total);
+        if (pid < 0)
+            failed = 1;
+        else
+            waitpid(pid, NULL, 0);
+    }
+    record("all", "attach", 6, monotonic() - start);
+    start = monotonic();
+    for (i = 0; i < count; i++)
+        if (pids[i] > 0)
+            kill(pids[i], SIGKILL);
+    for (i = 0; i < count; i++)
+        if (pids[i] > 0)
+            waitpid(pids[i], NULL, 0);
+    record("all", "teardown", 8, monotonic() - start);
+    report(count, json);
+    free(pids);
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    static int defaults[] = { 1, 100, 1000 };
+    char *mnexec = "./mnexec";
+    int c, i, cgroups = 0, json = 0, failed = 0;
+    ssize_t len;
+
+    while ((c = getopt(argc, argv, "+m:gjxXh")) != -1)
+        switch(c) {
+        case 'x':
+        case 'X':
+            /* We were exec'd by mnexec -t: report and exit or hold */
+            printf("stamp=%lld\n", monotonic());
+            fflush(stdout);
+            if (c == 'x')
+                return 0;
+            freopen("/dev/null", "w", stdout);
+            freopen("/dev/null", "w", stderr);
+            for (;;)
+                pause();
+        case 'm':
+            mnexec = optarg;
+            break;
+        case 'g':
+            cgroups = 1;
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+
+    len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len < 0) {
+        perror("readlink");
+        return 1;
+    }
+    self[len] = 0;
+    if (cgroups && mkgroup(1) != 0) {
+        fprintf(stderr, "mnexec-bench: could not create cgroup " GROUP "\n");
+        return 1;
+    }
+    if (optind < argc)
+        for (i = optind; i < argc; i++)
+            failed |= bench(mnexec, atoi(argv[i]), cgroups, json);
+    else
+        for (i = 0; i < 3; i++)
+            failed |= bench(mnexec, defaults[i], cgroups, json);
+    if (cgroups)
+        mkgroup(0);
+    return failed;
+}
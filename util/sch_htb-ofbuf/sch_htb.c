@@ -38,8 +38,16 @@
 #include <linux/rbtree.h>
 #include <linux/workqueue.h>
 #include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
+#include <linux/percpu.h>
+#include <linux/rtnetlink.h>
 #include <net/netlink.h>
 #include <net/pkt_sched.h>
+#include <net/inet_ecn.h>
+
+#define CREATE_TRACE_POINTS
+#include "sch_htb_trace.h"
 
 /* HTB algorithm.
     Author: devik@cdi.cz
@@ -65,6 +73,150 @@ static int htb_hysteresis __read_mostly = 0; /* whether to use mode hysteresis f
 module_param    (htb_hysteresis, int, 0640);
 MODULE_PARM_DESC(htb_hysteresis, "Hysteresis mode, less CPU load, less accurate");
 
+static int htb_timer_wheel __read_mostly = 0; /* event queue of new qdiscs */
+module_param    (htb_timer_wheel, int, 0640);
+MODULE_PARM_DESC(htb_timer_wheel, "Timer wheel instead of rb-tree event queues in new qdiscs, for many classes");
+
+static int htb_bulk __read_mostly = 1; /* packets taken from a leaf at once */
+module_param    (htb_bulk, int, 0640);
+MODULE_PARM_DESC(htb_bulk, "Max packets one dequeue takes from a leaf, 1 to disable bulk dequeue");
+static int htb_bulk_bytes __read_mostly = 65536;
+module_param    (htb_bulk_bytes, int, 0640);
+MODULE_PARM_DESC(htb_bulk_bytes, "Max bytes one dequeue takes from a leaf");
+
+static int htb_flow_cache __read_mostly = 0; /* flow cache in new qdiscs */
+module_param    (htb_flow_cache, int, 0640);
+MODULE_PARM_DESC(htb_flow_cache, "Cache the class of each flow in new qdiscs; only for filters that match on the flow alone (2 if tc actions are configured in: and carry no actions)");
+
+static int htb_telemetry __read_mostly = 0; /* sojourn stats in new qdiscs */
+module_param    (htb_telemetry, int, 0640);
+MODULE_PARM_DESC(htb_telemetry, "Timestamp packets of new qdiscs for sojourn time stats and the htb_sojourn tracepoint");
+
+/* Attributes of this version of HTB, in addition to the kernel's TCA_HTB_*.
+ * They are numbered from 32 so that attributes added to newer kernels
+ * cannot collide with them.
+ */
+enum {
+	TCA_HTB_OFBUF_LIMIT = 32,	/* u32, max packets in ofbuf; the qdisc's
+					 * is the default for new classes */
+	TCA_HTB_SHARED,			/* class: u32, shared bucket id, 0 for none */
+	TCA_HTB_CODEL_TARGET,		/* leaf: u32, CoDel target in us, 0 for off */
+	TCA_HTB_CODEL_INTERVAL,		/* leaf: u32, CoDel interval in us */
+	TCA_HTB_CODEL_ECN,		/* leaf: u32, 1 to mark ECT packets, not drop */
+	__TCA_HTB_XMAX
+};
+#define TCA_HTB_XMAX (__TCA_HTB_XMAX - 1)
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
+/* as in newer kernels, for rates of 2^32 bytes/s and above */
+#define TCA_HTB_RATE64	6	/* class: u64, bytes per second */
+#define TCA_HTB_CEIL64	7
+#endif
+
+/* A rate as the multiplier and shift that turn a length in bytes into
+ * its transmit time in ns, in place of qdisc_rate_table lookups: no
+ * table to miss in cache, no cell granularity, and 64-bit rates.
+ */
+struct htb_ratecfg {
+	u64	rate_bytes_ps;
+	u32	mult;
+	u16	overhead;
+	u16	mpu;
+	u8	shift;
+};
+
+static inline u64 htb_l2t_ns(const struct htb_ratecfg *r, unsigned int len)
+{
+	len += r->overhead;
+	if (len < r->mpu)
+		len = r->mpu;
+	return ((u64)len * r->mult) >> r->shift;
+}
+
+/* rate64 is used when conf->rate, in 32 bits, is too small for it */
+static void htb_ratecfg_precompute(struct htb_ratecfg *r,
+				   const struct tc_ratespec *conf, u64 rate64)
+{
+	memset(r, 0, sizeof(*r));
+	r->overhead = conf->overhead;
+	r->mpu = conf->mpu;
+	r->rate_bytes_ps = max_t(u64, conf->rate, rate64);
+	r->mult = 1;
+	/* time_in_ns = len * NSEC_PER_SEC / rate, that is (len * mult) >>
+	 * shift with the largest mult below 2^31; len * mult then always
+	 * fits in 64 bits.
+	 */
+	if (r->rate_bytes_ps > 0) {
+		u64 factor = NSEC_PER_SEC;
+
+		for (;;) {
+			r->mult = div64_u64(factor, r->rate_bytes_ps);
+			if (r->mult & (1U << 31) || factor & (1ULL << 63))
+				break;
+			factor <<= 1;
+			r->shift++;
+		}
+	}
+}
+
+static void htb_ratecfg_getrate(struct tc_ratespec *res,
+				const struct htb_ratecfg *r)
+{
+	memset(res, 0, sizeof(*res));
+	res->rate = min_t(u64, r->rate_bytes_ps, ~0U);
+	res->overhead = r->overhead;
+	res->mpu = r->mpu;
+}
+
+static inline s64 htb_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+/* Histograms of htb_telemetry: bucket 0 counts sojourn times below
+ * 2^10 ns and ofbuf lengths of 0, bucket i > 0 those in [2^(i-1), 2^i)
+ * times that, the last one also all above.
+ */
+#define HTB_SOJOURN_BUCKETS	20	/* up to 2^28 ns, about 270ms */
+#define HTB_OCCUPANCY_BUCKETS	12	/* up to 2^11 packets */
+
+/* class xstats: tc_htb_xstats, which tc reads, followed by ofbuf's and
+ * htb_telemetry's; the latter stay 0 unless it is on
+ */
+struct tc_htb_ofbuf_xstats {
+	struct tc_htb_xstats htb;
+	__u32	ofbuf_qlen;	/* packets in ofbuf */
+	__u32	ofbuf_backlog;	/* bytes in ofbuf */
+	__u32	ofbuf_limit;
+	__u32	ofbuf_drops;	/* dropped because ofbuf was full */
+	__u32	ofbuf_requeues;	/* moved from ofbuf into the leaf */
+	__u32	sojourn[HTB_SOJOURN_BUCKETS];	/* dequeues by sojourn time */
+	__u64	sojourn_ns;	/* sum of sojourn times */
+	__u32	ofbuf_occupancy[HTB_OCCUPANCY_BUCKETS];	/* enqueues by the
+							 * ofbuf qlen found */
+	__u32	codel_drops;	/* dropped by CoDel, in the leaf or ofbuf */
+	__u32	codel_marks;	/* CE marked instead */
+};
+
+/* CoDel state of one queue, as in sch_codel but in ns */
+struct htb_codel {
+	s64	first_above;	/* when sojourn will have been above target
+				 * for an interval, 0 if it is below */
+	s64	drop_next;	/* next drop while dropping */
+	u32	count;		/* drops since dropping began */
+	u32	lastcount;	/* count when dropping last began */
+	bool	dropping;
+};
+
+#define HTB_CODEL_INTERVAL	(100 * NSEC_PER_MSEC)	/* default */
+
+/* per-CPU part of the above, for each class */
+struct htb_telemetry {
+	u64	sojourn_ns;
+	u32	sojourn[HTB_SOJOURN_BUCKETS];
+	u32	ofbuf_occupancy[HTB_OCCUPANCY_BUCKETS];
+};
+
 /* used internaly to keep status of single class */
 enum htb_cmode {
 	HTB_CANT_SEND,		/* class can't send and can't borrow */
@@ -72,21 +224,32 @@ enum htb_cmode {
 	HTB_CAN_SEND		/* class can send */
 };
 
-/* interior & leaf nodes; props specific to leaves are marked L: */
+/* interior & leaf nodes; props specific to leaves are marked L:
+ *
+ * Fields come in the order of how often they are touched: first what
+ * htb_charge_class() reads and writes on every level for every packet,
+ * then what htb_dequeue_tree() walks, then the event queue linkage used
+ * on mode changes, and last, from a cache line of its own, configuration
+ * and statistics that only control and dump paths look at.
+ */
 struct htb_class {
-	struct Qdisc_class_common common;
-	/* general class parameters */
-	struct gnet_stats_basic_packed bstats;
-	struct gnet_stats_queue qstats;
-	struct gnet_stats_rate_est rate_est;
-	struct tc_htb_xstats xstats;	/* our special stats */
-	int refcnt;		/* usage count of this class */
-
-	/* topology */
-	int level;		/* our level (see above) */
-	unsigned int children;
+	/* charge path: token buckets, times in ns, and per-packet counters */
 	struct htb_class *parent;	/* parent class */
+	int level;		/* our level (see above) */
+	enum htb_cmode cmode;	/* current mode of the class */
+	int prio_activity;	/* for which prios are we active */
+	u32 lends, borrows;	/* for xstats */
+	s64 tokens, ctokens;	/* current number of tokens */
+	s64 t_c;		/* checkpoint time */
+	s64 buffer, cbuffer;	/* token bucket depth/rate */
+	s64 mbuffer;		/* max wait time */
+	struct htb_ratecfg rate;	/* rate of the class itself */
+	struct htb_ratecfg ceil;	/* ceiling rate (limits borrows too) */
+	struct htb_shared *shared;	/* where the above live, if shared */
+	struct gnet_stats_basic_packed bstats;
+	struct htb_telemetry __percpu *telemetry;	/* if htb_telemetry */
 
+	/* dequeue path */
 	int prio;		/* these two are used only by leaves... */
 	int quantum;		/* but stored for parent-to-leaf return */
 
@@ -95,6 +258,29 @@ struct htb_class {
 			struct Qdisc *q;
 			int deficit[TC_HTB_MAXDEPTH];
 			struct list_head drop_list;
+#if OFBUF
+			/* overflow buffer: packets that did not fit into q,
+			 * oldest first; they count in the qdisc's qlen
+			 */
+			struct sk_buff_head ofbuf;
+			u32 ofbuf_limit;	/* max qlen of above, 0 to disable */
+			u32 ofbuf_backlog;	/* bytes in above */
+			u32 ofbuf_drops;
+			u32 ofbuf_requeues;
+#endif
+			/* CoDel on the sojourn time in the class, off while
+			 * codel_target is 0
+			 */
+			s64 codel_target;
+			s64 codel_interval;
+			s64 codel_since;	/* when it was turned on */
+			bool codel_ecn;
+			struct htb_codel codel;		/* leaf, at dequeue */
+#if OFBUF
+			struct htb_codel ofbuf_codel;	/* ofbuf, at reinject */
+#endif
+			u32 codel_drops;
+			u32 codel_marks;
 		} leaf;
 		struct htb_class_inner {
 			struct rb_root feed[TC_HTB_NUMPRIO];	/* feed trees */
@@ -108,23 +294,23 @@ struct htb_class {
 		} inner;
 	} un;
 	struct rb_node node[TC_HTB_NUMPRIO];	/* node for self or feed tree */
+
+	/* event queue, on mode changes */
 	struct rb_node pq_node;	/* node for event queue */
-	psched_time_t pq_key;
+	struct hlist_node pq_hnode;	/* same, for the timer wheel */
+	s64 pq_key;
 
-	int prio_activity;	/* for which prios are we active */
-	enum htb_cmode cmode;	/* current mode of the class */
+	/* control and dump paths */
+	struct Qdisc_class_common common ____cacheline_aligned_in_smp;
+	struct gnet_stats_queue qstats;
+	struct gnet_stats_rate_est rate_est;
+	struct tc_htb_xstats xstats;	/* our special stats */
+	int refcnt;		/* usage count of this class */
+	unsigned int children;
 
 	/* class attached filters */
 	struct tcf_proto *filter_list;
 	int filter_cnt;
-
-	/* token bucket parameters */
-	struct qdisc_rate_table *rate;	/* rate table of the class itself */
-	struct qdisc_rate_table *ceil;	/* ceiling rate (limits borrows too) */
-	long buffer, cbuffer;	/* token bucket depth/rate */
-	psched_tdiff_t mbuffer;	/* max wait time */
-	long tokens, ctokens;	/* current number of tokens */
-	psched_time_t t_c;	/* checkpoint time */
 };
 
 struct htb_sched {
@@ -139,17 +325,26 @@ struct htb_sched {
 
 	/* self wait list - roots of wait PQs per row */
 	struct rb_root wait_pq[TC_HTB_MAXDEPTH];
+	struct htb_wheel *wheel[TC_HTB_MAXDEPTH];	/* or these, if set */
 
 	/* time of nearest event per level (row) */
-	psched_time_t near_ev_cache[TC_HTB_MAXDEPTH];
+	s64 near_ev_cache[TC_HTB_MAXDEPTH];
 
 	int defcls;		/* class where unclassified flows go to */
 
 	/* filters for qdisc itself */
 	struct tcf_proto *filter_list;
 
+	/* flow hash -> class cache, if enabled; entries of another
+	 * generation are stale
+	 */
+	struct htb_flow_cache __percpu *flow_cache;
+	u32 flow_gen;
+
+	bool telemetry;		/* htb_telemetry when we were created */
+
 	int rate2quantum;	/* quant = rate / rate2quantum */
-	psched_time_t now;	/* cached dequeue time */
+	s64 now;		/* cached dequeue time, ns */
 	struct qdisc_watchdog watchdog;
 
 	/* non shaped skbs; let them go directly thru */
@@ -158,10 +353,13 @@ struct htb_sched {
 
 	long direct_pkts;
 
+	/* packets already scheduled and charged by a bulk dequeue, handed
+	 * out by the next dequeues; they count in sch->q.qlen
+	 */
+	struct sk_buff_head bulk;
+
 #if OFBUF
-	/* overflow buffer */
-	struct sk_buff_head ofbuf;
-	int ofbuf_queued;	/* # packets queued in above */
+	u32 ofbuf_limit;	/* ofbuf limit of new classes */
 #endif
 
 #define HTB_WARN_TOOMANYEVENTS	0x1
@@ -169,6 +367,55 @@ struct htb_sched {
 	struct work_struct work;
 };
 
+/* Event queue as a hashed timer wheel, one per level, used instead of
+ * wait_pq when htb_timer_wheel was set at qdisc creation. A class waits
+ * in slot (pq_key >> HTB_WHEEL_GRAN_LOG) % HTB_WHEEL_SLOTS whatever the
+ * round, so adding and removing it are O(1); expiry visits only the
+ * slots between two dequeues, found through a bitmap, and in each only
+ * the classes that are due or due a round later.
+ */
+#define HTB_WHEEL_GRAN_LOG	16	/* slot width: 2^16 ns */
+#define HTB_WHEEL_SLOTS		256
+#define HTB_WHEEL_GRAN		((s64)1 << HTB_WHEEL_GRAN_LOG)
+#define HTB_WHEEL_HORIZON	(HTB_WHEEL_GRAN * HTB_WHEEL_SLOTS)
+
+struct htb_wheel {
+	struct hlist_head slot[HTB_WHEEL_SLOTS];
+	DECLARE_BITMAP(busy, HTB_WHEEL_SLOTS);	/* nonempty slots */
+	s64 clock;		/* start of the first slot not yet expired */
+	unsigned int count;	/* classes in the wheel */
+};
+
+/* Per-CPU cache of classification results by skb flow hash, so that
+ * packets of known flows skip the filter walk. Any change to classes or
+ * filters starts a new generation, which invalidates every entry; as
+ * not every filter change goes through a class operation, entries also
+ * age out after a second. Only correct when the filters match on what
+ * the flow hash covers: addresses, ports and protocol.
+ */
+#define HTB_FLOW_CACHE_SIZE	256	/* entries per CPU */
+
+struct htb_flow_entry {
+	u32 hash;		/* 0 for none */
+	u32 gen;
+	unsigned long stamp;	/* jiffies when cached */
+	struct htb_class *cl;	/* leaf or HTB_DIRECT */
+};
+
+struct htb_flow_cache {
+	struct htb_flow_entry e[HTB_FLOW_CACHE_SIZE];
+};
+
+#ifdef CONFIG_NET_CLS_ACT
+/* filters may carry actions (police, skbedit, mirred, ...), which packets
+ * of cached flows would skip, and their verdicts do not tell us whether
+ * they do; so it takes htb_flow_cache=2 to say that none do
+ */
+#define HTB_FLOW_CACHE_MIN	2
+#else
+#define HTB_FLOW_CACHE_MIN	1
+#endif
+
 /* find class in global hash table using given handle */
 static inline struct htb_class *htb_find(u32 handle, struct Qdisc *sch)
 {
@@ -181,6 +428,175 @@ static inline struct htb_class *htb_find(u32 handle, struct Qdisc *sch)
 	return container_of(clc, struct htb_class, common);
 }
 
+/* Token buckets shared by classes of several HTB instances on one device,
+ * typically the per-TX-queue children of mq: each instance keeps its own
+ * qdisc lock, classified leaves and event queue, and only charging a
+ * class takes the lock of its bucket, so one rate can be shaped across
+ * all queues while dequeues of different queues run in parallel.
+ * Classes share a bucket when they are on the same device and have the
+ * same TCA_HTB_SHARED id; they should be given the same rate and ceil.
+ * The device is keyed by pointer, as ifindex is only unique within a
+ * network namespace; it outlives its qdiscs and so our buckets.
+ */
+struct htb_shared {
+	struct hlist_node hnode;	/* in htb_shared_list */
+	struct net_device *dev;
+	u32 id;
+	int refcnt;		/* under htb_shared_lock */
+
+	spinlock_t lock;	/* protects the bucket below */
+	s64 tokens, ctokens;
+	s64 t_c;
+};
+
+/* few buckets, and only looked up when classes are changed */
+static HLIST_HEAD(htb_shared_list);
+static DEFINE_SPINLOCK(htb_shared_lock);
+
+/**
+ * htb_shared_get - finds or creates the bucket id of device dev
+ *
+ * A new bucket starts full, as a new class does. Returns NULL if out of
+ * memory.
+ */
+static struct htb_shared *htb_shared_get(struct net_device *dev, u32 id,
+					 s64 buffer, s64 cbuffer)
+{
+	struct htb_shared *sh, *new;
+	struct hlist_node *n;
+
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+
+	spin_lock_bh(&htb_shared_lock);
+	hlist_for_each_entry(sh, n, &htb_shared_list, hnode) {
+		if (sh->dev == dev && sh->id == id) {
+			sh->refcnt++;
+			spin_unlock_bh(&htb_shared_lock);
+			kfree(new);
+			return sh;
+		}
+	}
+	if (new) {
+		new->dev = dev;
+		new->id = id;
+		new->refcnt = 1;
+		spin_lock_init(&new->lock);
+		new->tokens = buffer;
+		new->ctokens = cbuffer;
+		new->t_c = htb_now();
+		hlist_add_head(&new->hnode, &htb_shared_list);
+	}
+	spin_unlock_bh(&htb_shared_lock);
+	return new;
+}
+
+static void htb_shared_put(struct htb_shared *sh)
+{
+	if (!sh)
+		return;
+	spin_lock_bh(&htb_shared_lock);
+	if (--sh->refcnt == 0)
+		hlist_del(&sh->hnode);
+	else
+		sh = NULL;
+	spin_unlock_bh(&htb_shared_lock);
+	kfree(sh);
+}
+
+/* loads cl's tokens from its shared bucket and locks it until
+ * htb_shared_unlock_class() stores them back; nothing for unshared
+ * classes
+ */
+static inline void htb_shared_lock_class(struct htb_class *cl, s64 now)
+{
+	struct htb_shared *sh = cl->shared;
+
+	if (!sh)
+		return;
+	spin_lock(&sh->lock);
+	cl->tokens = sh->tokens;
+	cl->ctokens = sh->ctokens;
+	/* another CPU may have charged at a slightly later now; credit
+	 * nothing then rather than a negative interval
+	 */
+	cl->t_c = min(sh->t_c, now);
+}
+
+static inline void htb_shared_unlock_class(struct htb_class *cl)
+{
+	struct htb_shared *sh = cl->shared;
+
+	if (!sh)
+		return;
+	sh->tokens = cl->tokens;
+	sh->ctokens = cl->ctokens;
+	/* never move the checkpoint back, which would credit the next
+	 * charge again with time already accounted for
+	 */
+	sh->t_c = max(sh->t_c, cl->t_c);
+	spin_unlock(&sh->lock);
+}
+
+/* loads cl's tokens from its shared bucket without charging anything */
+static inline void htb_shared_load_class(struct htb_class *cl, s64 now)
+{
+	htb_shared_lock_class(cl, now);
+	if (cl->shared)
+		spin_unlock(&cl->shared->lock);
+}
+
+#if OFBUF
+#define htb_ofbuf_len(cl)	skb_queue_len(&(cl)->un.leaf.ofbuf)
+#else
+#define htb_ofbuf_len(cl)	0
+#endif
+
+/* HTB's own part of skb->cb, past qdisc_skb_cb so that leaf qdiscs,
+ * which keep theirs in qdisc_skb_cb's data, do not overwrite it
+ */
+struct htb_skb_cb {
+	s64 tstamp;		/* htb_enqueue() time, ns */
+};
+
+#define HTB_SKB_CB_OFFSET	ALIGN(sizeof(struct qdisc_skb_cb), 8)
+
+static inline struct htb_skb_cb *htb_skb_cb(struct sk_buff *skb)
+{
+	BUILD_BUG_ON(HTB_SKB_CB_OFFSET + sizeof(struct htb_skb_cb) >
+		     sizeof(skb->cb));
+	return (struct htb_skb_cb *)(skb->cb + HTB_SKB_CB_OFFSET);
+}
+
+/* samples the ofbuf length of class cl as skb enters it */
+static inline void htb_telemetry_enqueue(struct htb_class *cl,
+					 struct sk_buff *skb)
+{
+	struct htb_telemetry *t = this_cpu_ptr(cl->telemetry);
+
+	t->ofbuf_occupancy[min_t(int, fls(htb_ofbuf_len(cl)),
+				 HTB_OCCUPANCY_BUCKETS - 1)]++;
+}
+
+/* accounts the sojourn time of skb, just dequeued from leaf cl */
+static inline void htb_telemetry_dequeue(struct htb_sched *q,
+					 struct htb_class *cl,
+					 struct sk_buff *skb)
+{
+	struct htb_telemetry *t;
+	s64 sojourn;
+
+	if (!cl->telemetry)
+		return;
+	t = this_cpu_ptr(cl->telemetry);
+	sojourn = max_t(s64, q->now - htb_skb_cb(skb)->tstamp, 0);
+	t->sojourn[min_t(int, fls64(sojourn >> 10),
+			 HTB_SOJOURN_BUCKETS - 1)]++;
+	t->sojourn_ns += sojourn;
+	trace_htb_sojourn(q->watchdog.qdisc->handle, cl->common.classid,
+			  sojourn, qdisc_pkt_len(skb), cl->un.leaf.q->q.qlen,
+			  htb_ofbuf_len(cl));
+}
+
 /**
  * htb_classify - classify a packet into class
  *
@@ -195,8 +611,9 @@ static inline struct htb_class *htb_find(u32 handle, struct Qdisc *sch)
  */
 #define HTB_DIRECT ((struct htb_class *)-1L)
 
-static struct htb_class *htb_classify(struct sk_buff *skb, struct Qdisc *sch,
-				      int *qerr)
+/* the filter and default class part of htb_classify() */
+static struct htb_class *htb_classify_filters(struct sk_buff *skb,
+					      struct Qdisc *sch, int *qerr)
 {
 	struct htb_sched *q = qdisc_priv(sch);
 	struct htb_class *cl;
@@ -204,16 +621,6 @@ static struct htb_class *htb_classify(struct sk_buff *skb, struct Qdisc *sch,
 	struct tcf_proto *tcf;
 	int result;
 
-	/* allow to select class by setting skb->priority to valid classid;
-	 * note that nfmark can be used too by attaching filter fw with no
-	 * rules in it
-	 */
-	if (skb->priority == sch->handle)
-		return HTB_DIRECT;	/* X:0 (direct flow) selected */
-	cl = htb_find(skb->priority, sch);
-	if (cl && cl->level == 0)
-		return cl;
-
 	*qerr = NET_XMIT_SUCCESS | __NET_XMIT_BYPASS;
 	tcf = q->filter_list;
 	while (tcf && (result = tc_classify(skb, tcf, &res)) >= 0) {
@@ -247,6 +654,58 @@ static struct htb_class *htb_classify(struct sk_buff *skb, struct Qdisc *sch,
 	return cl;
 }
 
+/* invalidates all cached flows; called under RTNL when classes or
+ * filters change, see htb_classify()
+ */
+static inline void htb_flow_cache_flush(struct htb_sched *q)
+{
+	smp_wmb();	/* RTNL is seen held before the new generation */
+	q->flow_gen++;
+}
+
+static struct htb_class *htb_classify(struct sk_buff *skb, struct Qdisc *sch,
+				      int *qerr)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	struct htb_flow_entry *e = NULL;
+	struct htb_class *cl;
+	u32 hash, gen = 0;
+
+	/* allow to select class by setting skb->priority to valid classid;
+	 * note that nfmark can be used too by attaching filter fw with no
+	 * rules in it
+	 */
+	if (skb->priority == sch->handle)
+		return HTB_DIRECT;	/* X:0 (direct flow) selected */
+	cl = htb_find(skb->priority, sch);
+	if (cl && cl->level == 0)
+		return cl;
+
+	if (q->flow_cache && (hash = skb_get_rxhash(skb)) != 0) {
+		gen = q->flow_gen;
+		e = this_cpu_ptr(q->flow_cache)->e + hash % HTB_FLOW_CACHE_SIZE;
+		if (e->hash == hash && e->gen == gen &&
+		    time_before(jiffies, e->stamp + HZ))
+			return e->cl;
+		/* tc flushes the cache before it changes filters, and some
+		 * changes have no hook after; so results found while RTNL
+		 * is held may come from the old filters and are not cached
+		 */
+		smp_rmb();
+		if (rtnl_is_locked())
+			e = NULL;
+	}
+
+	cl = htb_classify_filters(skb, sch, qerr);
+	if (e && cl) {
+		e->hash = hash;
+		e->gen = gen;
+		e->stamp = jiffies;
+		e->cl = cl;
+	}
+	return cl;
+}
+
 /**
  * htb_add_to_id_tree - adds class to the round robin list
  *
@@ -276,11 +735,11 @@ static void htb_add_to_id_tree(struct rb_root *root,
  * htb_add_to_wait_tree - adds class to the event queue with delay
  *
  * The class is added to priority event queue to indicate that class will
- * change its mode in cl->pq_key microseconds. Make sure that class is not
+ * change its mode in cl->pq_key nanoseconds. Make sure that class is not
  * already in the queue.
  */
 static void htb_add_to_wait_tree(struct htb_sched *q,
-				 struct htb_class *cl, long delay)
+				 struct htb_class *cl, s64 delay)
 {
 	struct rb_node **p = &q->wait_pq[cl->level].rb_node, *parent = NULL;
 
@@ -292,6 +751,17 @@ static void htb_add_to_wait_tree(struct htb_sched *q,
 	if (q->near_ev_cache[cl->level] > cl->pq_key)
 		q->near_ev_cache[cl->level] = cl->pq_key;
 
+	if (q->wheel[cl->level]) {
+		struct htb_wheel *w = q->wheel[cl->level];
+		unsigned int s = (cl->pq_key >> HTB_WHEEL_GRAN_LOG) %
+				 HTB_WHEEL_SLOTS;
+
+		hlist_add_head(&cl->pq_hnode, w->slot + s);
+		__set_bit(s, w->busy);
+		w->count++;
+		return;
+	}
+
 	while (*p) {
 		struct htb_class *c;
 		parent = *p;
@@ -344,6 +814,30 @@ static void htb_safe_rb_erase(struct rb_node *rb, struct rb_root *root)
 	}
 }
 
+/**
+ * htb_remove_from_wait_tree - removes class from the event queue
+ *
+ * The class must be in the queue, i.e. not in HTB_CAN_SEND mode.
+ */
+static void htb_remove_from_wait_tree(struct htb_sched *q,
+				      struct htb_class *cl)
+{
+	struct htb_wheel *w = q->wheel[cl->level];
+	unsigned int s;
+
+	if (!w) {
+		htb_safe_rb_erase(&cl->pq_node, q->wait_pq + cl->level);
+		return;
+	}
+	if (hlist_unhashed(&cl->pq_hnode))
+		return;
+	hlist_del_init(&cl->pq_hnode);
+	w->count--;
+	s = (cl->pq_key >> HTB_WHEEL_GRAN_LOG) % HTB_WHEEL_SLOTS;
+	if (hlist_empty(w->slot + s))
+		__clear_bit(s, w->busy);
+}
+
 
 /**
  * htb_remove_class_from_row - removes class from its row
@@ -448,14 +942,14 @@ static void htb_deactivate_prios(struct htb_sched *q, struct htb_class *cl)
 		htb_remove_class_from_row(q, cl, mask);
 }
 
-static inline long htb_lowater(const struct htb_class *cl)
+static inline s64 htb_lowater(const struct htb_class *cl)
 {
 	if (htb_hysteresis)
 		return cl->cmode != HTB_CANT_SEND ? -cl->cbuffer : 0;
 	else
 		return 0;
 }
-static inline long htb_hiwater(const struct htb_class *cl)
+static inline s64 htb_hiwater(const struct htb_class *cl)
 {
 	if (htb_hysteresis)
 		return cl->cmode == HTB_CAN_SEND ? -cl->buffer : 0;
@@ -476,9 +970,9 @@ static inline long htb_hiwater(const struct htb_class *cl)
  * mode transitions per time unit. The speed gain is about 1/6.
  */
 static inline enum htb_cmode
-htb_class_mode(struct htb_class *cl, long *diff)
+htb_class_mode(struct htb_class *cl, s64 *diff)
 {
-	long toks;
+	s64 toks;
 
 	if ((toks = (cl->ctokens + *diff)) < htb_lowater(cl)) {
 		*diff = -toks;
@@ -502,7 +996,7 @@ htb_class_mode(struct htb_class *cl, long *diff)
  * to mode other than HTB_CAN_SEND (see htb_add_to_wait_tree).
  */
 static void
-htb_change_class_mode(struct htb_sched *q, struct htb_class *cl, long *diff)
+htb_change_class_mode(struct htb_sched *q, struct htb_class *cl, s64 *diff)
 {
 	enum htb_cmode new_mode = htb_class_mode(cl, diff);
 
@@ -553,17 +1047,234 @@ static inline void htb_deactivate(struct htb_sched *q, struct htb_class *cl)
 	list_del_init(&cl->un.leaf.drop_list);
 }
 
+/* time skb spent in class cl until now; packets queued before CoDel was
+ * turned on may carry no stamp, so count from then at most
+ */
+static inline s64 htb_codel_sojourn(const struct htb_class *cl,
+				    struct sk_buff *skb, s64 now)
+{
+	return now - max(htb_skb_cb(skb)->tstamp,
+			 cl->un.leaf.codel_since);
+}
+
+/* CoDel's control law: the next drop, interval / sqrt(count) after t.
+ * The spacing stops shrinking after 2^11 drops, at about interval / 45.
+ */
+static inline s64 htb_codel_next(s64 t, u32 count, s64 interval)
+{
+	unsigned long n = min_t(u32, count, 1 << 11);
+
+	return t + div_u64((u64)interval << 10, int_sqrt(n << 20));
+}
+
+/**
+ * htb_codel_check - CoDel's verdict on a packet of class cl
+ *
+ * The packet waited sojourn ns and leaves more packets behind it in the
+ * queue c is kept for. Returns true if it should be dropped or marked.
+ * As in sch_codel, the queue becomes a dropping one once sojourn times
+ * have stayed above target for an interval, and then drops at shrinking
+ * intervals until they fall below, resuming at a higher rate if this
+ * happens again soon. The last packet of a queue is never dropped.
+ */
+static bool htb_codel_check(struct htb_codel *c, const struct htb_class *cl,
+			    s64 sojourn, s64 now, bool more)
+{
+	s64 interval = cl->un.leaf.codel_interval;
+	u32 delta;
+
+	if (sojourn < cl->un.leaf.codel_target || !more) {
+		c->first_above = 0;
+		c->dropping = false;
+		return false;
+	}
+	if (!c->first_above) {
+		c->first_above = now + interval;
+		return false;
+	}
+	if (c->dropping) {
+		if (now < c->drop_next)
+			return false;
+		c->count++;
+		c->drop_next = htb_codel_next(c->drop_next, c->count,
+					      interval);
+		return true;
+	}
+	if (now < c->first_above)
+		return false;
+
+	c->dropping = true;
+	delta = c->count - c->lastcount;
+	if (delta > 1 && now - c->drop_next < 16 * interval)
+		c->count = delta;
+	else
+		c->count = 1;
+	c->lastcount = c->count;
+	c->drop_next = htb_codel_next(now, c->count, interval);
+	return true;
+}
+
+/* acts on a CoDel verdict for skb of class cl: marks it if ECN is on
+ * and skb is ECN capable and returns false, else returns true for the
+ * caller to drop it
+ */
+static inline bool htb_codel_drop(struct htb_class *cl, struct sk_buff *skb)
+{
+	if (cl->un.leaf.codel_ecn && INET_ECN_set_ce(skb)) {
+		cl->un.leaf.codel_marks++;
+		return false;
+	}
+	cl->un.leaf.codel_drops++;
+	cl->qstats.drops++;
+	return true;
+}
+
+/**
+ * htb_leaf_dequeue - dequeues a packet from leaf cl
+ *
+ * With CoDel on, packets it drops are accounted and freed here, and the
+ * next one is taken instead; as the last packet is never dropped, this
+ * returns NULL only if the leaf did.
+ */
+static struct sk_buff *htb_leaf_dequeue(struct htb_sched *q,
+					struct htb_class *cl)
+{
+	struct Qdisc *sch = q->watchdog.qdisc;
+	struct sk_buff *skb;
+
+	while ((skb = cl->un.leaf.q->dequeue(cl->un.leaf.q)) != NULL) {
+		if (likely(!cl->un.leaf.codel_target) ||
+		    !htb_codel_check(&cl->un.leaf.codel, cl,
+				     htb_codel_sojourn(cl, skb, q->now),
+				     q->now, cl->un.leaf.q->q.qlen != 0) ||
+		    !htb_codel_drop(cl, skb))
+			break;
+		sch->qstats.drops++;
+		sch->q.qlen--;
+		qdisc_tree_decrease_qlen(sch, 1);
+		kfree_skb(skb);
+	}
+	return skb;
+}
+
+#if OFBUF
+/**
+ * htb_ofbuf_park - queues a packet into the ofbuf of leaf cl
+ *
+ * Used for packets the leaf refused, and for any packet while older
+ * ones wait in ofbuf, so that the class stays FIFO. For the former we
+ * hold a reference of our own to skb, taken before the leaf enqueue, so
+ * the packet is still valid although the leaf dropped it. Once ofbuf is
+ * full, the packet is dropped here, at enqueue time.
+ */
+static int htb_ofbuf_park(struct Qdisc *sch, struct htb_class *cl,
+			  struct sk_buff *skb)
+{
+	if (htb_ofbuf_len(cl) >= cl->un.leaf.ofbuf_limit) {
+		kfree_skb(skb);
+		sch->qstats.drops++;
+		cl->qstats.drops++;
+		cl->un.leaf.ofbuf_drops++;
+		return NET_XMIT_DROP;
+	}
+	__skb_queue_tail(&cl->un.leaf.ofbuf, skb);
+	cl->un.leaf.ofbuf_backlog += qdisc_pkt_len(skb);
+	sch->q.qlen++;
+	return NET_XMIT_SUCCESS;
+}
+
+/**
+ * htb_ofbuf_reinject - moves the oldest packet in cl's ofbuf into its leaf
+ *
+ * Called when leaf cl has just dequeued, or was found empty, so that it
+ * has room for one more. Packets an empty leaf still refuses are dropped
+ * lest they wait forever, as are those that CoDel, if on, drops for
+ * their time in ofbuf. This is O(1) per dequeue whatever the ofbuf
+ * length.
+ */
+static void htb_ofbuf_reinject(struct htb_sched *q, struct htb_class *cl,
+			       struct Qdisc *sch)
+{
+	struct sk_buff *skb;
+	int ret;
+
+	while ((skb = skb_peek(&cl->un.leaf.ofbuf)) != NULL) {
+		if (cl->un.leaf.codel_target &&
+		    htb_codel_check(&cl->un.leaf.ofbuf_codel, cl,
+				    htb_codel_sojourn(cl, skb, q->now),
+				    q->now, htb_ofbuf_len(cl) > 1) &&
+		    htb_codel_drop(cl, skb)) {
+			__skb_unlink(skb, &cl->un.leaf.ofbuf);
+			cl->un.leaf.ofbuf_backlog -= qdisc_pkt_len(skb);
+			sch->qstats.drops++;
+			sch->q.qlen--;
+			qdisc_tree_decrease_qlen(sch, 1);
+			kfree_skb(skb);
+			continue;
+		}
+		skb_get(skb);
+		ret = qdisc_enqueue(skb, cl->un.leaf.q);
+		if (ret != NET_XMIT_SUCCESS && net_xmit_drop_count(ret) &&
+		    cl->un.leaf.q->q.qlen)
+			return;		/* still full; keep it where it is */
+
+		__skb_unlink(skb, &cl->un.leaf.ofbuf);
+		cl->un.leaf.ofbuf_backlog -= qdisc_pkt_len(skb);
+		if (ret == NET_XMIT_SUCCESS) {
+			bstats_update(&cl->bstats, skb);
+			cl->un.leaf.ofbuf_requeues++;
+			htb_activate(q, cl);
+			kfree_skb(skb);
+			return;
+		}
+		if (net_xmit_drop_count(ret)) {
+			sch->qstats.drops++;
+			cl->qstats.drops++;
+		}
+		sch->q.qlen--;
+		qdisc_tree_decrease_qlen(sch, 1);
+		kfree_skb(skb);
+	}
+}
+
+/* drops all of cl's ofbuf, when cl's leaf goes away */
+static void htb_ofbuf_purge(struct Qdisc *sch, struct htb_class *cl)
+{
+	unsigned int n = htb_ofbuf_len(cl);
+
+	if (!n)
+		return;
+	__skb_queue_purge(&cl->un.leaf.ofbuf);
+	cl->un.leaf.ofbuf_backlog = 0;
+	sch->q.qlen -= n;
+	qdisc_tree_decrease_qlen(sch, n);
+}
+#endif
+
 static int htb_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 {
 	int uninitialized_var(ret);
 	struct htb_sched *q = qdisc_priv(sch);
 	struct htb_class *cl = htb_classify(skb, sch, &ret);
-
 #if OFBUF
-    if(cl != HTB_DIRECT && cl)
-        skb_get(skb);
+	/* while older packets wait in ofbuf, newer ones queue behind them;
+	 * otherwise keep skb alive for ofbuf should the leaf drop it
+	 */
+	bool behind = cl && cl != HTB_DIRECT && htb_ofbuf_len(cl);
+	bool park = cl && cl != HTB_DIRECT && !behind &&
+		    cl->un.leaf.ofbuf_limit;
+
+	if (park)
+		skb_get(skb);
 #endif
 
+	if (cl && cl != HTB_DIRECT) {
+		if (cl->telemetry || cl->un.leaf.codel_target)
+			htb_skb_cb(skb)->tstamp = htb_now();
+		if (cl->telemetry)
+			htb_telemetry_enqueue(cl, skb);
+	}
+
 	if (cl == HTB_DIRECT) {
 		/* enqueue to helper queue */
 		if (q->direct_queue.qlen < q->direct_qlen) {
@@ -580,27 +1291,32 @@ static int htb_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 			sch->qstats.drops++;
 		kfree_skb(skb);
 		return ret;
+#endif
+#if OFBUF
+	} else if (behind) {
+		return htb_ofbuf_park(sch, cl, skb);
 #endif
 	} else if ((ret = qdisc_enqueue(skb, cl->un.leaf.q)) != NET_XMIT_SUCCESS) {
-        /* We shouldn't drop this, but enqueue it into ofbuf */
-        // TODO: is skb actually valid?
-        // Ans: looks like qdisc_enqueue will end up freeing the packet
-        // if enqueue failed.  So we should incr refcnt before calling qdisc_enqueue...
 #if OFBUF
-        __skb_queue_tail(&q->ofbuf, skb);
-        q->ofbuf_queued++;
-#else 
+		/* the leaf is full: park the packet rather than drop it,
+		 * unless the leaf takes nothing at all (e.g. noop_qdisc)
+		 */
+		if (park && net_xmit_drop_count(ret) && cl->un.leaf.q->q.qlen)
+			return htb_ofbuf_park(sch, cl, skb);
+		if (park)
+			kfree_skb(skb);
+#endif
 		if (net_xmit_drop_count(ret)) {
 			sch->qstats.drops++;
 			cl->qstats.drops++;
 		}
 		return ret;
-#endif
 	} else {
 		bstats_update(&cl->bstats, skb);
 		htb_activate(q, cl);
 #if OFBUF
-        kfree_skb(skb);
+		if (park)
+			kfree_skb(skb);
 #endif
 	}
 
@@ -608,26 +1324,26 @@ static int htb_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 	return NET_XMIT_SUCCESS;
 }
 
-static inline void htb_accnt_tokens(struct htb_class *cl, int bytes, long diff)
+static inline void htb_accnt_tokens(struct htb_class *cl, int bytes, s64 diff)
 {
-	long toks = diff + cl->tokens;
+	s64 toks = diff + cl->tokens;
 
 	if (toks > cl->buffer)
 		toks = cl->buffer;
-	toks -= (long) qdisc_l2t(cl->rate, bytes);
+	toks -= (s64) htb_l2t_ns(&cl->rate, bytes);
 	if (toks <= -cl->mbuffer)
 		toks = 1 - cl->mbuffer;
 
 	cl->tokens = toks;
 }
 
-static inline void htb_accnt_ctokens(struct htb_class *cl, int bytes, long diff)
+static inline void htb_accnt_ctokens(struct htb_class *cl, int bytes, s64 diff)
 {
-	long toks = diff + cl->ctokens;
+	s64 toks = diff + cl->ctokens;
 
 	if (toks > cl->cbuffer)
 		toks = cl->cbuffer;
-	toks -= (long) qdisc_l2t(cl->ceil, bytes);
+	toks -= (s64) htb_l2t_ns(&cl->ceil, bytes);
 	if (toks <= -cl->mbuffer)
 		toks = 1 - cl->mbuffer;
 
@@ -650,27 +1366,29 @@ static void htb_charge_class(struct htb_sched *q, struct htb_class *cl,
 {
 	int bytes = qdisc_pkt_len(skb);
 	enum htb_cmode old_mode;
-	long diff;
+	s64 diff;
 
 	while (cl) {
-		diff = psched_tdiff_bounded(q->now, cl->t_c, cl->mbuffer);
+		htb_shared_lock_class(cl, q->now);
+		diff = min_t(s64, q->now - cl->t_c, cl->mbuffer);
 		if (cl->level >= level) {
 			if (cl->level == level)
-				cl->xstats.lends++;
+				cl->lends++;
 			htb_accnt_tokens(cl, bytes, diff);
 		} else {
-			cl->xstats.borrows++;
+			cl->borrows++;
 			cl->tokens += diff;	/* we moved t_c; update tokens */
 		}
 		htb_accnt_ctokens(cl, bytes, diff);
 		cl->t_c = q->now;
+		htb_shared_unlock_class(cl);
 
 		old_mode = cl->cmode;
 		diff = 0;
 		htb_change_class_mode(q, cl, &diff);
 		if (old_mode != cl->cmode) {
 			if (old_mode != HTB_CAN_SEND)
-				htb_safe_rb_erase(&cl->pq_node, q->wait_pq + cl->level);
+				htb_remove_from_wait_tree(q, cl);
 			if (cl->cmode != HTB_CAN_SEND)
 				htb_add_to_wait_tree(q, cl, diff);
 		}
@@ -683,6 +1401,121 @@ static void htb_charge_class(struct htb_sched *q, struct htb_class *cl,
 	}
 }
 
+/* applies the event of class cl, just taken off the event queue */
+static void htb_class_event(struct htb_sched *q, struct htb_class *cl)
+{
+	s64 diff;
+
+	/* other instances may have spent shared tokens meanwhile */
+	htb_shared_load_class(cl, q->now);
+	diff = min_t(s64, q->now - cl->t_c, cl->mbuffer);
+	htb_change_class_mode(q, cl, &diff);
+	if (cl->cmode != HTB_CAN_SEND)
+		htb_add_to_wait_tree(q, cl, diff);
+}
+
+/* distance in slots from the clock's slot to the first nonempty slot at
+ * least "from" slots ahead, wrapping around; HTB_WHEEL_SLOTS + from if
+ * the wheel is empty
+ */
+static unsigned int htb_wheel_next(const struct htb_wheel *w,
+				   unsigned int from)
+{
+	unsigned int base = (w->clock >> HTB_WHEEL_GRAN_LOG) % HTB_WHEEL_SLOTS;
+	unsigned int n, d;
+
+	n = find_next_bit(w->busy, HTB_WHEEL_SLOTS,
+			  (base + from) % HTB_WHEEL_SLOTS);
+	if (n >= HTB_WHEEL_SLOTS)
+		n = find_first_bit(w->busy, HTB_WHEEL_SLOTS);
+	if (n >= HTB_WHEEL_SLOTS)
+		return HTB_WHEEL_SLOTS + from;
+
+	d = (n + HTB_WHEEL_SLOTS - base) % HTB_WHEEL_SLOTS;
+	if (d < from)
+		d += HTB_WHEEL_SLOTS;
+	return d;
+}
+
+/**
+ * htb_wheel_expire - applies the due events of the clock's slot
+ *
+ * Returns the earliest pq_key left in the slot, 0 if none.
+ */
+static s64 htb_wheel_expire(struct htb_sched *q, struct htb_wheel *w)
+{
+	unsigned int s = (w->clock >> HTB_WHEEL_GRAN_LOG) % HTB_WHEEL_SLOTS;
+	struct hlist_node *n, *next;
+	struct htb_class *cl;
+	s64 first = 0;
+
+	/* classes re-added by htb_class_event go to the head of their
+	 * slot, so this pass does not see them again
+	 */
+	hlist_for_each_entry_safe(cl, n, next, w->slot + s, pq_hnode) {
+		if (cl->pq_key > q->now) {
+			if (!first || cl->pq_key < first)
+				first = cl->pq_key;
+			continue;
+		}
+		htb_remove_from_wait_tree(q, cl);
+		htb_class_event(q, cl);
+	}
+	return first;
+}
+
+/**
+ * htb_wheel_do_events - htb_do_events for the timer wheel
+ *
+ * Expires slot by slot, skipping empty ones, up to the one holding
+ * q->now. The next event returned may be early, at the start of a slot
+ * whose classes are all due a round later; that costs one extra scan
+ * of the slot.
+ */
+static s64 htb_wheel_do_events(struct htb_sched *q, int level,
+			       unsigned long start)
+{
+	struct htb_wheel *w = q->wheel[level];
+	unsigned long stop_at = start + 2;
+	s64 slot, first, next;
+
+	if (!w->count) {
+		w->clock = q->now & ~(HTB_WHEEL_GRAN - 1);
+		return 0;
+	}
+	/* after a long idle time one round sees every slot */
+	if (q->now - w->clock >= HTB_WHEEL_HORIZON)
+		w->clock = (q->now & ~(HTB_WHEEL_GRAN - 1)) -
+			   HTB_WHEEL_HORIZON + HTB_WHEEL_GRAN;
+
+	while (w->count && time_before(jiffies, stop_at)) {
+		slot = w->clock + htb_wheel_next(w, 0) * HTB_WHEEL_GRAN;
+		if (slot > q->now)
+			return slot;
+		w->clock = slot;
+		first = htb_wheel_expire(q, w);
+
+		if (slot + HTB_WHEEL_GRAN > q->now) {
+			/* q->now is in this slot: done for now */
+			next = w->clock + htb_wheel_next(w, 1) * HTB_WHEEL_GRAN;
+			if (first && first < next)
+				next = first;
+			return w->count ? next : 0;
+		}
+		w->clock += HTB_WHEEL_GRAN;
+	}
+	if (!w->count)
+		return 0;
+
+	/* too much load - let's continue after a break for scheduling */
+	if (!(q->warned & HTB_WARN_TOOMANYEVENTS)) {
+		pr_warning("htb: too many events!\n");
+		q->warned |= HTB_WARN_TOOMANYEVENTS;
+	}
+
+	return q->now;
+}
+
 /**
  * htb_do_events - make mode changes to classes at the level
  *
@@ -690,17 +1523,20 @@ static void htb_charge_class(struct htb_sched *q, struct htb_class *cl,
  * next pending event (0 for no event in pq, q->now for too many events).
  * Note: Applied are events whose have cl->pq_key <= q->now.
  */
-static psched_time_t htb_do_events(struct htb_sched *q, int level,
-				   unsigned long start)
+static s64 htb_do_events(struct htb_sched *q, int level,
+			 unsigned long start)
 {
 	/* don't run for longer than 2 jiffies; 2 is used instead of
 	 * 1 to simplify things when jiffy is going to be incremented
 	 * too soon
 	 */
 	unsigned long stop_at = start + 2;
+
+	if (q->wheel[level])
+		return htb_wheel_do_events(q, level, start);
+
 	while (time_before(jiffies, stop_at)) {
 		struct htb_class *cl;
-		long diff;
 		struct rb_node *p = rb_first(&q->wait_pq[level]);
 
 		if (!p)
@@ -711,10 +1547,7 @@ static psched_time_t htb_do_events(struct htb_sched *q, int level,
 			return cl->pq_key;
 
 		htb_safe_rb_erase(p, q->wait_pq + level);
-		diff = psched_tdiff_bounded(q->now, cl->t_c, cl->mbuffer);
-		htb_change_class_mode(q, cl, &diff);
-		if (cl->cmode != HTB_CAN_SEND)
-			htb_add_to_wait_tree(q, cl, diff);
+		htb_class_event(q, cl);
 	}
 
 	/* too much load - let's continue after a break for scheduling */
@@ -806,6 +1639,72 @@ static struct htb_class *htb_lookup_leaf(struct rb_root *tree, int prio,
 	return NULL;
 }
 
+/* whether leaf cl may still send at level: it can send on its own, or
+ * borrow from its ancestor at that level
+ */
+static inline bool htb_may_dequeue(const struct htb_class *cl, int level)
+{
+	for (; cl->level < level; cl = cl->parent)
+		if (cl->cmode != HTB_MAY_BORROW)
+			return false;
+	return cl->level == level && cl->cmode == HTB_CAN_SEND;
+}
+
+/* takes skb off leaf cl's deficit at level; returns true if that ends
+ * cl's turn in the round robin
+ */
+static inline bool htb_use_deficit(struct htb_sched *q, struct htb_class *cl,
+				   int prio, int level, struct sk_buff *skb)
+{
+	cl->un.leaf.deficit[level] -= qdisc_pkt_len(skb);
+	if (cl->un.leaf.deficit[level] >= 0)
+		return false;
+	cl->un.leaf.deficit[level] += cl->quantum;
+	htb_next_rb_node((level ? cl->parent->un.inner.ptr : q->
+			  ptr[0]) + prio);
+	return true;
+}
+
+/**
+ * htb_dequeue_bulk - takes more packets from the leaf just dequeued
+ *
+ * After htb_dequeue_tree() took "bytes" from leaf cl at prio/level
+ * without ending cl's turn, moves more of cl's packets to q->bulk for
+ * as long as the round robin would pick cl again: cl is still active
+ * and may send at level, and its deficit lasts. Each packet is charged
+ * at once, so tokens, modes and deficits end up as if they had been
+ * dequeued one by one, but the event handling and the row scan run once
+ * per batch. A class becoming active meanwhile at a better priority
+ * waits for the batch to go out.
+ */
+static void htb_dequeue_bulk(struct htb_sched *q, struct htb_class *cl,
+			     int prio, int level, unsigned int bytes)
+{
+	int budget = htb_bulk - 1;
+	struct sk_buff *skb;
+	bool turn_over;
+
+	while (budget-- > 0 && bytes < htb_bulk_bytes) {
+		if (!cl->prio_activity || !htb_may_dequeue(cl, level))
+			break;
+		skb = htb_leaf_dequeue(q, cl);
+		if (unlikely(!skb))
+			break;
+#if OFBUF
+		htb_ofbuf_reinject(q, cl, q->watchdog.qdisc);
+#endif
+		bytes += qdisc_pkt_len(skb);
+		htb_telemetry_dequeue(q, cl, skb);
+		turn_over = htb_use_deficit(q, cl, prio, level, skb);
+		if (!cl->un.leaf.q->q.qlen)
+			htb_deactivate(q, cl);
+		htb_charge_class(q, cl, level, skb);
+		__skb_queue_tail(&q->bulk, skb);
+		if (turn_over)
+			break;
+	}
+}
+
 /* dequeues packet at given priority and level; call only if
  * you are sure that there is active class at prio/level
  */
@@ -829,6 +1728,10 @@ next:
 		 * graft operation on the leaf since last dequeue;
 		 * simply deactivate and skip such class
 		 */
+#if OFBUF
+		if (unlikely(cl->un.leaf.q->q.qlen == 0) && htb_ofbuf_len(cl))
+			htb_ofbuf_reinject(q, cl, q->watchdog.qdisc);
+#endif
 		if (unlikely(cl->un.leaf.q->q.qlen == 0)) {
 			struct htb_class *next;
 			htb_deactivate(q, cl);
@@ -847,9 +1750,13 @@ next:
 			goto next;
 		}
 
-		skb = cl->un.leaf.q->dequeue(cl->un.leaf.q);
-		if (likely(skb != NULL))
+		skb = htb_leaf_dequeue(q, cl);
+		if (likely(skb != NULL)) {
+#if OFBUF
+			htb_ofbuf_reinject(q, cl, q->watchdog.qdisc);
+#endif
 			break;
+		}
 
 		qdisc_warn_nonwc("htb", cl->un.leaf.q);
 		htb_next_rb_node((level ? cl->parent->un.inner.ptr : q->
@@ -861,18 +1768,18 @@ next:
 	} while (cl != start);
 
 	if (likely(skb != NULL)) {
-		cl->un.leaf.deficit[level] -= qdisc_pkt_len(skb);
-		if (cl->un.leaf.deficit[level] < 0) {
-			cl->un.leaf.deficit[level] += cl->quantum;
-			htb_next_rb_node((level ? cl->parent->un.inner.ptr : q->
-					  ptr[0]) + prio);
-		}
+		bool turn_over = htb_use_deficit(q, cl, prio, level, skb);
+
+		htb_telemetry_dequeue(q, cl, skb);
+
 		/* this used to be after charge_class but this constelation
 		 * gives us slightly better performance
 		 */
 		if (!cl->un.leaf.q->q.qlen)
 			htb_deactivate(q, cl);
 		htb_charge_class(q, cl, level, skb);
+		if (htb_bulk > 1 && !turn_over)
+			htb_dequeue_bulk(q, cl, prio, level, qdisc_pkt_len(skb));
 	}
 	return skb;
 }
@@ -882,10 +1789,15 @@ static struct sk_buff *htb_dequeue(struct Qdisc *sch)
 	struct sk_buff *skb;
 	struct htb_sched *q = qdisc_priv(sch);
 	int level;
-	psched_time_t next_event;
+	s64 next_event;
 	unsigned long start_at;
-    u32 r, i;
-    struct sk_buff *pkt;
+
+	/* packets of the last bulk dequeue were scheduled before anything
+	 * else here
+	 */
+	skb = __skb_dequeue(&q->bulk);
+	if (skb != NULL)
+		goto ok;
 
 	/* try to dequeue direct packets as high prio (!) to minimize cpu work */
 	skb = __skb_dequeue(&q->direct_queue);
@@ -894,42 +1806,25 @@ ok:
 		qdisc_bstats_update(sch, skb);
 		qdisc_unthrottled(sch);
 		sch->q.qlen--;
-#if OFBUF
-        if(q->ofbuf_queued > 0) {
-            i = 0;
-            r = net_random() % q->ofbuf_queued;
-            // enqueue the rth packet and drop the rest
-            while((pkt = __skb_dequeue(&q->ofbuf)) != NULL) {
-                if(i == r) {
-                    // the chosen one
-                    htb_enqueue(pkt, sch);
-                } else {
-                    kfree_skb(pkt);
-                }
-                i++;
-            }
-            q->ofbuf_queued = 0;
-        }
-#endif
 		return skb;
 	}
 
 	if (!sch->q.qlen)
 		goto fin;
-	q->now = psched_get_time();
+	q->now = htb_now();
 	start_at = jiffies;
 
-	next_event = q->now + 5 * PSCHED_TICKS_PER_SEC;
+	next_event = q->now + 5LLU * NSEC_PER_SEC;
 
 	for (level = 0; level < TC_HTB_MAXDEPTH; level++) {
 		/* common case optimization - skip event handler quickly */
 		int m;
-		psched_time_t event;
+		s64 event;
 
 		if (q->now >= q->near_ev_cache[level]) {
 			event = htb_do_events(q, level, start_at);
 			if (!event)
-				event = q->now + PSCHED_TICKS_PER_SEC;
+				event = q->now + NSEC_PER_SEC;
 			q->near_ev_cache[level] = event;
 		} else
 			event = q->near_ev_cache[level];
@@ -949,7 +1844,8 @@ ok:
 	}
 	sch->qstats.overlimits++;
 	if (likely(next_event > q->now))
-		qdisc_watchdog_schedule(&q->watchdog, next_event);
+		qdisc_watchdog_schedule(&q->watchdog,
+					PSCHED_NS2TICKS(next_event));
 	else
 		schedule_work(&q->work);
 fin:
@@ -968,6 +1864,21 @@ static unsigned int htb_drop(struct Qdisc *sch)
 			struct htb_class *cl = list_entry(p, struct htb_class,
 							  un.leaf.drop_list);
 			unsigned int len;
+#if OFBUF
+			/* the newest packets of a class are in its ofbuf */
+			struct sk_buff *skb;
+
+			skb = __skb_dequeue_tail(&cl->un.leaf.ofbuf);
+			if (skb) {
+				len = qdisc_pkt_len(skb);
+				cl->un.leaf.ofbuf_backlog -= len;
+				cl->un.leaf.ofbuf_drops++;
+				cl->qstats.drops++;
+				kfree_skb(skb);
+				sch->q.qlen--;
+				return len;
+			}
+#endif
 			if (cl->un.leaf.q->ops->drop &&
 			    (len = cl->un.leaf.q->ops->drop(cl->un.leaf.q))) {
 				sch->q.qlen--;
@@ -996,33 +1907,45 @@ static void htb_reset(struct Qdisc *sch)
 			else {
 				if (cl->un.leaf.q)
 					qdisc_reset(cl->un.leaf.q);
+#if OFBUF
+				__skb_queue_purge(&cl->un.leaf.ofbuf);
+				cl->un.leaf.ofbuf_backlog = 0;
+#endif
 				INIT_LIST_HEAD(&cl->un.leaf.drop_list);
 			}
 			cl->prio_activity = 0;
 			cl->cmode = HTB_CAN_SEND;
+			INIT_HLIST_NODE(&cl->pq_hnode);
 
 		}
 	}
 	qdisc_watchdog_cancel(&q->watchdog);
 	__skb_queue_purge(&q->direct_queue);
+	__skb_queue_purge(&q->bulk);
 	sch->q.qlen = 0;
-#if OFBUF
-    __skb_queue_purge(&q->ofbuf);
-    q->ofbuf_queued = 0;
-#endif
 	memset(q->row, 0, sizeof(q->row));
 	memset(q->row_mask, 0, sizeof(q->row_mask));
 	memset(q->wait_pq, 0, sizeof(q->wait_pq));
+	for (i = 0; i < TC_HTB_MAXDEPTH; i++)
+		if (q->wheel[i])
+			memset(q->wheel[i], 0, sizeof(*q->wheel[i]));
 	memset(q->ptr, 0, sizeof(q->ptr));
 	for (i = 0; i < TC_HTB_NUMPRIO; i++)
 		INIT_LIST_HEAD(q->drops + i);
 }
 
-static const struct nla_policy htb_policy[TCA_HTB_MAX + 1] = {
+static const struct nla_policy htb_policy[TCA_HTB_XMAX + 1] = {
 	[TCA_HTB_PARMS]	= { .len = sizeof(struct tc_htb_opt) },
 	[TCA_HTB_INIT]	= { .len = sizeof(struct tc_htb_glob) },
 	[TCA_HTB_CTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
 	[TCA_HTB_RTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
+	[TCA_HTB_RATE64] = { .type = NLA_U64 },
+	[TCA_HTB_CEIL64] = { .type = NLA_U64 },
+	[TCA_HTB_OFBUF_LIMIT] = { .type = NLA_U32 },
+	[TCA_HTB_SHARED] = { .type = NLA_U32 },
+	[TCA_HTB_CODEL_TARGET] = { .type = NLA_U32 },
+	[TCA_HTB_CODEL_INTERVAL] = { .type = NLA_U32 },
+	[TCA_HTB_CODEL_ECN] = { .type = NLA_U32 },
 };
 
 static void htb_work_func(struct work_struct *work)
@@ -1033,10 +1956,23 @@ static void htb_work_func(struct work_struct *work)
 	__netif_schedule(qdisc_root(sch));
 }
 
+/* frees the optional timer wheels and flow cache */
+static void htb_free_tables(struct htb_sched *q)
+{
+	int i;
+
+	for (i = 0; i < TC_HTB_MAXDEPTH; i++) {
+		kfree(q->wheel[i]);
+		q->wheel[i] = NULL;
+	}
+	free_percpu(q->flow_cache);
+	q->flow_cache = NULL;
+}
+
 static int htb_init(struct Qdisc *sch, struct nlattr *opt)
 {
 	struct htb_sched *q = qdisc_priv(sch);
-	struct nlattr *tb[TCA_HTB_INIT + 1];
+	struct nlattr *tb[TCA_HTB_XMAX + 1];
 	struct tc_htb_glob *gopt;
 	int err;
 	int i;
@@ -1044,7 +1980,7 @@ static int htb_init(struct Qdisc *sch, struct nlattr *opt)
 	if (!opt)
 		return -EINVAL;
 
-	err = nla_parse_nested(tb, TCA_HTB_INIT, opt, htb_policy);
+	err = nla_parse_nested(tb, TCA_HTB_XMAX, opt, htb_policy);
 	if (err < 0)
 		return err;
 
@@ -1059,29 +1995,54 @@ static int htb_init(struct Qdisc *sch, struct nlattr *opt)
 		return -EINVAL;
 	}
 
+	if (htb_timer_wheel) {
+		for (i = 0; i < TC_HTB_MAXDEPTH; i++) {
+			q->wheel[i] = kzalloc(sizeof(*q->wheel[i]), GFP_KERNEL);
+			if (!q->wheel[i]) {
+				htb_free_tables(q);
+				return -ENOMEM;
+			}
+		}
+	}
+	if (htb_flow_cache >= HTB_FLOW_CACHE_MIN) {
+		q->flow_cache = alloc_percpu(struct htb_flow_cache);
+		if (!q->flow_cache) {
+			htb_free_tables(q);
+			return -ENOMEM;
+		}
+	} else if (htb_flow_cache) {
+		pr_warning("HTB: not using the flow cache, as filters may carry tc actions; set htb_flow_cache=2 if none do\n");
+	}
+
 	err = qdisc_class_hash_init(&q->clhash);
-	if (err < 0)
+	if (err < 0) {
+		htb_free_tables(q);
 		return err;
+	}
 	for (i = 0; i < TC_HTB_NUMPRIO; i++)
 		INIT_LIST_HEAD(q->drops + i);
 
 	qdisc_watchdog_init(&q->watchdog, sch);
 	INIT_WORK(&q->work, htb_work_func);
 	skb_queue_head_init(&q->direct_queue);
-
-#if OFBUF
-    skb_queue_head_init(&q->ofbuf);
-    q->ofbuf_queued = 0;
-#endif
+	skb_queue_head_init(&q->bulk);
 
 	q->direct_qlen = qdisc_dev(sch)->tx_queue_len;
 
 	if (q->direct_qlen < 2)	/* some devices have zero tx_queue_len */
 		q->direct_qlen = 2;
 
+#if OFBUF
+	/* by default ofbuf holds as much as the device queue */
+	q->ofbuf_limit = q->direct_qlen;
+	if (tb[TCA_HTB_OFBUF_LIMIT])
+		q->ofbuf_limit = nla_get_u32(tb[TCA_HTB_OFBUF_LIMIT]);
+#endif
+
 	if ((q->rate2quantum = gopt->rate2quantum) < 1)
 		q->rate2quantum = 1;
 	q->defcls = gopt->defcls;
+	q->telemetry = htb_telemetry;
 
 	return 0;
 }
@@ -1105,6 +2066,9 @@ static int htb_dump(struct Qdisc *sch, struct sk_buff *skb)
 	if (nest == NULL)
 		goto nla_put_failure;
 	NLA_PUT(skb, TCA_HTB_INIT, sizeof(gopt), &gopt);
+#if OFBUF
+	NLA_PUT_U32(skb, TCA_HTB_OFBUF_LIMIT, q->ofbuf_limit);
+#endif
 	nla_nest_end(skb, nest);
 
 	spin_unlock_bh(root_lock);
@@ -1136,14 +2100,31 @@ static int htb_dump_class(struct Qdisc *sch, unsigned long arg,
 
 	memset(&opt, 0, sizeof(opt));
 
-	opt.rate = cl->rate->rate;
-	opt.buffer = cl->buffer;
-	opt.ceil = cl->ceil->rate;
-	opt.cbuffer = cl->cbuffer;
+	htb_ratecfg_getrate(&opt.rate, &cl->rate);
+	opt.buffer = PSCHED_NS2TICKS(cl->buffer);
+	htb_ratecfg_getrate(&opt.ceil, &cl->ceil);
+	opt.cbuffer = PSCHED_NS2TICKS(cl->cbuffer);
 	opt.quantum = cl->quantum;
 	opt.prio = cl->prio;
 	opt.level = cl->level;
 	NLA_PUT(skb, TCA_HTB_PARMS, sizeof(opt), &opt);
+	if (cl->rate.rate_bytes_ps >= (1ULL << 32))
+		NLA_PUT_U64(skb, TCA_HTB_RATE64, cl->rate.rate_bytes_ps);
+	if (cl->ceil.rate_bytes_ps >= (1ULL << 32))
+		NLA_PUT_U64(skb, TCA_HTB_CEIL64, cl->ceil.rate_bytes_ps);
+#if OFBUF
+	if (!cl->level)
+		NLA_PUT_U32(skb, TCA_HTB_OFBUF_LIMIT, cl->un.leaf.ofbuf_limit);
+#endif
+	if (cl->shared)
+		NLA_PUT_U32(skb, TCA_HTB_SHARED, cl->shared->id);
+	if (!cl->level && cl->un.leaf.codel_target) {
+		NLA_PUT_U32(skb, TCA_HTB_CODEL_TARGET,
+			    div_u64(cl->un.leaf.codel_target, NSEC_PER_USEC));
+		NLA_PUT_U32(skb, TCA_HTB_CODEL_INTERVAL,
+			    div_u64(cl->un.leaf.codel_interval, NSEC_PER_USEC));
+		NLA_PUT_U32(skb, TCA_HTB_CODEL_ECN, cl->un.leaf.codel_ecn);
+	}
 
 	nla_nest_end(skb, nest);
 	spin_unlock_bh(root_lock);
@@ -1159,18 +2140,62 @@ static int
 htb_dump_class_stats(struct Qdisc *sch, unsigned long arg, struct gnet_dump *d)
 {
 	struct htb_class *cl = (struct htb_class *)arg;
+#if OFBUF
+	struct tc_htb_ofbuf_xstats xstats;
+#endif
 
-	if (!cl->level && cl->un.leaf.q)
+	if (!cl->level && cl->un.leaf.q) {
 		cl->qstats.qlen = cl->un.leaf.q->q.qlen;
-	cl->xstats.tokens = cl->tokens;
-	cl->xstats.ctokens = cl->ctokens;
+#if OFBUF
+		/* what waits in ofbuf is backlog of the class too */
+		cl->qstats.qlen += htb_ofbuf_len(cl);
+		cl->qstats.backlog = cl->un.leaf.q->qstats.backlog +
+				     cl->un.leaf.ofbuf_backlog;
+#endif
+	}
+	cl->xstats.lends = cl->lends;
+	cl->xstats.borrows = cl->borrows;
+	cl->xstats.tokens = clamp_t(s64, PSCHED_NS2TICKS(cl->tokens),
+				    INT_MIN, INT_MAX);
+	cl->xstats.ctokens = clamp_t(s64, PSCHED_NS2TICKS(cl->ctokens),
+				     INT_MIN, INT_MAX);
 
 	if (gnet_stats_copy_basic(d, &cl->bstats) < 0 ||
 	    gnet_stats_copy_rate_est(d, NULL, &cl->rate_est) < 0 ||
 	    gnet_stats_copy_queue(d, &cl->qstats) < 0)
 		return -1;
 
+#if OFBUF
+	memset(&xstats, 0, sizeof(xstats));
+	xstats.htb = cl->xstats;
+	if (!cl->level) {
+		xstats.ofbuf_qlen = htb_ofbuf_len(cl);
+		xstats.ofbuf_backlog = cl->un.leaf.ofbuf_backlog;
+		xstats.ofbuf_limit = cl->un.leaf.ofbuf_limit;
+		xstats.ofbuf_drops = cl->un.leaf.ofbuf_drops;
+		xstats.ofbuf_requeues = cl->un.leaf.ofbuf_requeues;
+		xstats.codel_drops = cl->un.leaf.codel_drops;
+		xstats.codel_marks = cl->un.leaf.codel_marks;
+	}
+	if (cl->telemetry) {
+		int cpu, i;
+
+		for_each_possible_cpu(cpu) {
+			const struct htb_telemetry *t;
+
+			t = per_cpu_ptr(cl->telemetry, cpu);
+			for (i = 0; i < HTB_SOJOURN_BUCKETS; i++)
+				xstats.sojourn[i] += t->sojourn[i];
+			xstats.sojourn_ns += t->sojourn_ns;
+			for (i = 0; i < HTB_OCCUPANCY_BUCKETS; i++)
+				xstats.ofbuf_occupancy[i] +=
+					t->ofbuf_occupancy[i];
+		}
+	}
+	return gnet_stats_copy_app(d, &xstats, sizeof(xstats));
+#else
 	return gnet_stats_copy_app(d, &cl->xstats, sizeof(cl->xstats));
+#endif
 }
 
 static int htb_graft(struct Qdisc *sch, unsigned long arg, struct Qdisc *new,
@@ -1192,6 +2217,9 @@ static int htb_graft(struct Qdisc *sch, unsigned long arg, struct Qdisc *new,
 		qdisc_tree_decrease_qlen(*old, (*old)->q.qlen);
 		qdisc_reset(*old);
 	}
+#if OFBUF
+	htb_ofbuf_purge(sch, cl);
+#endif
 	sch_tree_unlock(sch);
 	return 0;
 }
@@ -1206,7 +2234,8 @@ static void htb_qlen_notify(struct Qdisc *sch, unsigned long arg)
 {
 	struct htb_class *cl = (struct htb_class *)arg;
 
-	if (cl->un.leaf.q->q.qlen == 0)
+	/* ofbuf refills the leaf at its next dequeue */
+	if (cl->un.leaf.q->q.qlen == 0 && !htb_ofbuf_len(cl))
 		htb_deactivate(qdisc_priv(sch), cl);
 }
 
@@ -1237,15 +2266,24 @@ static void htb_parent_to_leaf(struct htb_sched *q, struct htb_class *cl,
 	WARN_ON(cl->level || !cl->un.leaf.q || cl->prio_activity);
 
 	if (parent->cmode != HTB_CAN_SEND)
-		htb_safe_rb_erase(&parent->pq_node, q->wait_pq + parent->level);
+		htb_remove_from_wait_tree(q, parent);
 
 	parent->level = 0;
 	memset(&parent->un.inner, 0, sizeof(parent->un.inner));
 	INIT_LIST_HEAD(&parent->un.leaf.drop_list);
+#if OFBUF
+	skb_queue_head_init(&parent->un.leaf.ofbuf);
+	parent->un.leaf.ofbuf_limit = q->ofbuf_limit;
+#endif
+	parent->un.leaf.codel_target = 0;
+	parent->un.leaf.codel_interval = 0;
+	parent->un.leaf.codel_ecn = false;
+	parent->un.leaf.codel_drops = 0;
+	parent->un.leaf.codel_marks = 0;
 	parent->un.leaf.q = new_q ? new_q : &noop_qdisc;
 	parent->tokens = parent->buffer;
 	parent->ctokens = parent->cbuffer;
-	parent->t_c = psched_get_time();
+	parent->t_c = htb_now();
 	parent->cmode = HTB_CAN_SEND;
 }
 
@@ -1254,10 +2292,13 @@ static void htb_destroy_class(struct Qdisc *sch, struct htb_class *cl)
 	if (!cl->level) {
 		WARN_ON(!cl->un.leaf.q);
 		qdisc_destroy(cl->un.leaf.q);
+#if OFBUF
+		__skb_queue_purge(&cl->un.leaf.ofbuf);
+#endif
 	}
 	gen_kill_estimator(&cl->bstats, &cl->rate_est);
-	qdisc_put_rtab(cl->rate);
-	qdisc_put_rtab(cl->ceil);
+	free_percpu(cl->telemetry);
+	htb_shared_put(cl->shared);
 
 	tcf_destroy_chain(&cl->filter_list);
 	kfree(cl);
@@ -1290,10 +2331,8 @@ static void htb_destroy(struct Qdisc *sch)
 	}
 	qdisc_class_hash_destroy(&q->clhash);
 	__skb_queue_purge(&q->direct_queue);
-#if OFBUF
-    __skb_queue_purge(&q->ofbuf);
-    q->ofbuf_queued = 0;
-#endif
+	__skb_queue_purge(&q->bulk);
+	htb_free_tables(q);
 }
 
 static int htb_delete(struct Qdisc *sch, unsigned long arg)
@@ -1317,11 +2356,15 @@ static int htb_delete(struct Qdisc *sch, unsigned long arg)
 	}
 
 	sch_tree_lock(sch);
+	htb_flow_cache_flush(q);
 
 	if (!cl->level) {
 		qlen = cl->un.leaf.q->q.qlen;
 		qdisc_reset(cl->un.leaf.q);
 		qdisc_tree_decrease_qlen(cl->un.leaf.q, qlen);
+#if OFBUF
+		htb_ofbuf_purge(sch, cl);
+#endif
 	}
 
 	/* delete from hash and active; remainder in destroy_class */
@@ -1333,7 +2376,7 @@ static int htb_delete(struct Qdisc *sch, unsigned long arg)
 		htb_deactivate(q, cl);
 
 	if (cl->cmode != HTB_CAN_SEND)
-		htb_safe_rb_erase(&cl->pq_node, q->wait_pq + cl->level);
+		htb_remove_from_wait_tree(q, cl);
 
 	if (last_child)
 		htb_parent_to_leaf(q, cl, new_q);
@@ -1352,10 +2395,28 @@ static void htb_put(struct Qdisc *sch, unsigned long arg)
 {
 	struct htb_class *cl = (struct htb_class *)arg;
 
+	/* filters of cl may have changed while it was held */
+	htb_flow_cache_flush(qdisc_priv(sch));
 	if (--cl->refcnt == 0)
 		htb_destroy_class(sch, cl);
 }
 
+/* sets the CoDel target of leaf cl to us microseconds, 0 turning it off */
+static void htb_codel_set_target(struct htb_class *cl, u32 us)
+{
+	if (us && !cl->un.leaf.codel_target) {
+		memset(&cl->un.leaf.codel, 0, sizeof(cl->un.leaf.codel));
+#if OFBUF
+		memset(&cl->un.leaf.ofbuf_codel, 0,
+		       sizeof(cl->un.leaf.ofbuf_codel));
+#endif
+		cl->un.leaf.codel_since = htb_now();
+		if (!cl->un.leaf.codel_interval)
+			cl->un.leaf.codel_interval = HTB_CODEL_INTERVAL;
+	}
+	cl->un.leaf.codel_target = (s64)NSEC_PER_USEC * us;
+}
+
 static int htb_change_class(struct Qdisc *sch, u32 classid,
 			    u32 parentid, struct nlattr **tca,
 			    unsigned long *arg)
@@ -1364,15 +2425,16 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 	struct htb_sched *q = qdisc_priv(sch);
 	struct htb_class *cl = (struct htb_class *)*arg, *parent;
 	struct nlattr *opt = tca[TCA_OPTIONS];
-	struct qdisc_rate_table *rtab = NULL, *ctab = NULL;
-	struct nlattr *tb[__TCA_HTB_MAX];
+	struct htb_shared *shared = NULL;
+	struct nlattr *tb[TCA_HTB_XMAX + 1];
 	struct tc_htb_opt *hopt;
+	u64 rate64, ceil64;
 
 	/* extract all subattrs from opt attr */
 	if (!opt)
 		goto failure;
 
-	err = nla_parse_nested(tb, TCA_HTB_MAX, opt, htb_policy);
+	err = nla_parse_nested(tb, TCA_HTB_XMAX, opt, htb_policy);
 	if (err < 0)
 		goto failure;
 
@@ -1383,12 +2445,23 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 	parent = parentid == TC_H_ROOT ? NULL : htb_find(parentid, sch);
 
 	hopt = nla_data(tb[TCA_HTB_PARMS]);
-
-	rtab = qdisc_get_rtab(&hopt->rate, tb[TCA_HTB_RTAB]);
-	ctab = qdisc_get_rtab(&hopt->ceil, tb[TCA_HTB_CTAB]);
-	if (!rtab || !ctab)
+	if (!hopt->rate.rate || !hopt->ceil.rate)
 		goto failure;
 
+	rate64 = tb[TCA_HTB_RATE64] ? nla_get_u64(tb[TCA_HTB_RATE64]) : 0;
+	ceil64 = tb[TCA_HTB_CEIL64] ? nla_get_u64(tb[TCA_HTB_CEIL64]) : 0;
+
+	if (tb[TCA_HTB_SHARED] && nla_get_u32(tb[TCA_HTB_SHARED])) {
+		err = -ENOBUFS;
+		shared = htb_shared_get(qdisc_dev(sch),
+					nla_get_u32(tb[TCA_HTB_SHARED]),
+					PSCHED_TICKS2NS(hopt->buffer),
+					PSCHED_TICKS2NS(hopt->cbuffer));
+		if (!shared)
+			goto failure;
+		err = -EINVAL;
+	}
+
 	if (!cl) {		/* new class */
 		struct Qdisc *new_q;
 		int prio;
@@ -1421,11 +2494,19 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 		cl = kzalloc(sizeof(*cl), GFP_KERNEL);
 		if (!cl)
 			goto failure;
+		if (q->telemetry) {
+			cl->telemetry = alloc_percpu(struct htb_telemetry);
+			if (!cl->telemetry) {
+				kfree(cl);
+				goto failure;
+			}
+		}
 
 		err = gen_new_estimator(&cl->bstats, &cl->rate_est,
 					qdisc_root_sleeping_lock(sch),
 					tca[TCA_RATE] ? : &est.nla);
 		if (err) {
+			free_percpu(cl->telemetry);
 			kfree(cl);
 			goto failure;
 		}
@@ -1433,7 +2514,12 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 		cl->refcnt = 1;
 		cl->children = 0;
 		INIT_LIST_HEAD(&cl->un.leaf.drop_list);
+#if OFBUF
+		skb_queue_head_init(&cl->un.leaf.ofbuf);
+		cl->un.leaf.ofbuf_limit = q->ofbuf_limit;
+#endif
 		RB_CLEAR_NODE(&cl->pq_node);
+		INIT_HLIST_NODE(&cl->pq_hnode);
 
 		for (prio = 0; prio < TC_HTB_NUMPRIO; prio++)
 			RB_CLEAR_NODE(&cl->node[prio]);
@@ -1449,6 +2535,9 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 			unsigned int qlen = parent->un.leaf.q->q.qlen;
 
 			/* turn parent into inner node */
+#if OFBUF
+			htb_ofbuf_purge(sch, parent);
+#endif
 			qdisc_reset(parent->un.leaf.q);
 			qdisc_tree_decrease_qlen(parent->un.leaf.q, qlen);
 			qdisc_destroy(parent->un.leaf.q);
@@ -1457,7 +2546,7 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 
 			/* remove from evt list because of level change */
 			if (parent->cmode != HTB_CAN_SEND) {
-				htb_safe_rb_erase(&parent->pq_node, q->wait_pq);
+				htb_remove_from_wait_tree(q, parent);
 				parent->cmode = HTB_CAN_SEND;
 			}
 			parent->level = (parent->parent ? parent->parent->level
@@ -1471,10 +2560,10 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 		cl->parent = parent;
 
 		/* set class to be in HTB_CAN_SEND state */
-		cl->tokens = hopt->buffer;
-		cl->ctokens = hopt->cbuffer;
-		cl->mbuffer = 60 * PSCHED_TICKS_PER_SEC;	/* 1min */
-		cl->t_c = psched_get_time();
+		cl->tokens = PSCHED_TICKS2NS(hopt->buffer);
+		cl->ctokens = PSCHED_TICKS2NS(hopt->cbuffer);
+		cl->mbuffer = 60ULL * NSEC_PER_SEC;	/* 1min */
+		cl->t_c = htb_now();
 		cl->cmode = HTB_CAN_SEND;
 
 		/* attach to the hash list and parent's family */
@@ -1487,7 +2576,7 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 						    qdisc_root_sleeping_lock(sch),
 						    tca[TCA_RATE]);
 			if (err)
-				return err;
+				goto failure;
 		}
 		sch_tree_lock(sch);
 	}
@@ -1495,8 +2584,12 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 	/* it used to be a nasty bug here, we have to check that node
 	 * is really leaf before changing cl->un.leaf !
 	 */
+	htb_ratecfg_precompute(&cl->rate, &hopt->rate, rate64);
+	htb_ratecfg_precompute(&cl->ceil, &hopt->ceil, ceil64);
+
 	if (!cl->level) {
-		cl->quantum = rtab->rate.rate / q->rate2quantum;
+		cl->quantum = min_t(u64, div_u64(cl->rate.rate_bytes_ps,
+						 q->rate2quantum), INT_MAX);
 		if (!hopt->quantum && cl->quantum < 1000) {
 			pr_warning(
 			       "HTB: quantum of class %X is small. Consider r2q change.\n",
@@ -1513,17 +2606,34 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 			cl->quantum = hopt->quantum;
 		if ((cl->prio = hopt->prio) >= TC_HTB_NUMPRIO)
 			cl->prio = TC_HTB_NUMPRIO - 1;
+#if OFBUF
+		if (tb[TCA_HTB_OFBUF_LIMIT])
+			cl->un.leaf.ofbuf_limit =
+				nla_get_u32(tb[TCA_HTB_OFBUF_LIMIT]);
+#endif
+		if (tb[TCA_HTB_CODEL_TARGET])
+			htb_codel_set_target(cl,
+				nla_get_u32(tb[TCA_HTB_CODEL_TARGET]));
+		if (tb[TCA_HTB_CODEL_INTERVAL] &&
+		    nla_get_u32(tb[TCA_HTB_CODEL_INTERVAL]))
+			cl->un.leaf.codel_interval = (s64)NSEC_PER_USEC *
+				nla_get_u32(tb[TCA_HTB_CODEL_INTERVAL]);
+		if (tb[TCA_HTB_CODEL_ECN])
+			cl->un.leaf.codel_ecn =
+				!!nla_get_u32(tb[TCA_HTB_CODEL_ECN]);
 	}
 
-	cl->buffer = hopt->buffer;
-	cl->cbuffer = hopt->cbuffer;
-	if (cl->rate)
-		qdisc_put_rtab(cl->rate);
-	cl->rate = rtab;
-	if (cl->ceil)
-		qdisc_put_rtab(cl->ceil);
-	cl->ceil = ctab;
+	cl->buffer = PSCHED_TICKS2NS(hopt->buffer);
+	cl->cbuffer = PSCHED_TICKS2NS(hopt->cbuffer);
+	htb_flow_cache_flush(q);
+	if (tb[TCA_HTB_SHARED]) {
+		struct htb_shared *old = cl->shared;
+
+		cl->shared = shared;
+		shared = old;	/* put below, outside the tree lock */
+	}
 	sch_tree_unlock(sch);
+	htb_shared_put(shared);
 
 	qdisc_class_hash_grow(sch, &q->clhash);
 
@@ -1531,10 +2641,7 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 	return 0;
 
 failure:
-	if (rtab)
-		qdisc_put_rtab(rtab);
-	if (ctab)
-		qdisc_put_rtab(ctab);
+	htb_shared_put(shared);
 	return err;
 }
 
@@ -1544,6 +2651,8 @@ static struct tcf_proto **htb_find_tcf(struct Qdisc *sch, unsigned long arg)
 	struct htb_class *cl = (struct htb_class *)arg;
 	struct tcf_proto **fl = cl ? &cl->filter_list : &q->filter_list;
 
+	/* the caller is about to change filters */
+	htb_flow_cache_flush(q);
 	return fl;
 }
 
@@ -1563,6 +2672,7 @@ static unsigned long htb_bind_filter(struct Qdisc *sch, unsigned long parent,
 	 */
 	if (cl)
 		cl->filter_cnt++;
+	htb_flow_cache_flush(qdisc_priv(sch));
 	return (unsigned long)cl;
 }
 
@@ -1572,6 +2682,7 @@ static void htb_unbind_filter(struct Qdisc *sch, unsigned long arg)
 
 	if (cl)
 		cl->filter_cnt--;
+	htb_flow_cache_flush(qdisc_priv(sch));
 }
 
 static void htb_walk(struct Qdisc *sch, struct qdisc_walker *arg)
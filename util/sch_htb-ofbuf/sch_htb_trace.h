@@ -0,0 +1,57 @@
+/* Tracepoints for the ofbuf sch_htb
+ *
+ * sch_htb:htb_sojourn fires for every packet a leaf class dequeues,
+ * with the time it spent in HTB (ofbuf and leaf) since htb_enqueue(),
+ * when the module is loaded with htb_telemetry=1, e.g. for
+ *
+ *   echo 1 > /sys/kernel/debug/tracing/events/sch_htb/htb_sojourn/enable
+ *
+ * Disabled tracepoints cost a not-taken branch.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sch_htb
+
+#if !defined(_SCH_HTB_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCH_HTB_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(htb_sojourn,
+
+	TP_PROTO(u32 handle, u32 classid, s64 sojourn_ns, unsigned int len,
+		 u32 qlen, u32 ofbuf_qlen),
+
+	TP_ARGS(handle, classid, sojourn_ns, len, qlen, ofbuf_qlen),
+
+	TP_STRUCT__entry(
+		__field(u32, handle)
+		__field(u32, classid)
+		__field(s64, sojourn_ns)
+		__field(unsigned int, len)
+		__field(u32, qlen)
+		__field(u32, ofbuf_qlen)
+	),
+
+	TP_fast_assign(
+		__entry->handle = handle;
+		__entry->classid = classid;
+		__entry->sojourn_ns = sojourn_ns;
+		__entry->len = len;
+		__entry->qlen = qlen;
+		__entry->ofbuf_qlen = ofbuf_qlen;
+	),
+
+	TP_printk("qdisc=%x: class=%x:%x sojourn_ns=%lld len=%u qlen=%u ofbuf_qlen=%u",
+		  __entry->handle >> 16, __entry->classid >> 16,
+		  __entry->classid & 0xffff, __entry->sojourn_ns,
+		  __entry->len, __entry->qlen, __entry->ofbuf_qlen)
+);
+
+#endif /* _SCH_HTB_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sch_htb_trace
+#include <trace/define_trace.h>